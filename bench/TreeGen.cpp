@@ -0,0 +1,285 @@
+//==============================================================================
+// TreeGen.cpp
+// created October 16, 2026
+//==============================================================================
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+/*
+ * Note: treegen makes a pair of synthetic directories, DIR/A and DIR/B, shaped
+ * to stress one part of a backup. Everything is derived from the seed, so the
+ * same arguments always make the same trees (byte for byte, though not with the
+ * same mtimes). The shapes are:
+ *
+ *   tiny    many small files (20,000 per unit of scale) in directories of 100
+ *   huge    four large files (64 MiB per unit of scale)
+ *   wide    one directory of 50,000 small files per unit of scale
+ *   deep    eight chains of directories 100 deep per unit of scale (at most
+ *           400), with a couple of small files at each level
+ *   sparse  eight files of 1 GiB per unit of scale, mostly holes
+ *   mixed   a little of each
+ *
+ * The two sides overlap in part: roughly half of the files (and of the
+ * directories, where there are several) are in both, identical, and a quarter
+ * are only in A, to be copied, and a quarter only in B, to be deleted.
+ */
+
+//------------------------------------------------------------------------------
+// SplitMix64, which is plenty for making up file contents.
+static uint64_t mix (uint64_t x) {
+   x += 0x9E3779B97F4A7C15ull;
+   x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+   x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+   return x ^ (x >> 31);
+}
+
+//------------------------------------------------------------------------------
+static uint64_t hashOf (string const& s, uint64_t seed) {
+   uint64_t h = mix(seed);
+   for (unsigned char c : s) {
+      h = mix(h ^ c);
+   }
+   return h;
+}
+
+//------------------------------------------------------------------------------
+class TreeGen {
+private:
+   string _root;
+   uint64_t _seed;
+   uint64_t _state;
+   vector<char> _buf;
+   unsigned long _files[2];
+   unsigned long long _bytes[2];
+
+public:
+   static const unsigned A = 1;
+   static const unsigned B = 2;
+   static const unsigned Both = 3;
+
+public:
+   TreeGen (string const& root, uint64_t seed): _root(root), _seed(seed), _state(seed) {
+      _files[0] = _files[1] = 0;
+      _bytes[0] = _bytes[1] = 0;
+   }
+
+   uint64_t next () { return _state = mix(_state); }
+   unsigned below (unsigned n) { return next() % n; }
+   // A, B, or both: half are shared, and the rest split between the sides
+   unsigned sides () {
+      unsigned r = below(4);
+      return r < 2 ? Both : r == 2 ? A : B;
+   }
+
+   void dir (string const& rel, unsigned which);
+   void file (string const& rel, size_t size, unsigned which);
+   void sparseFile (string const& rel, off_t size, unsigned extents, unsigned which);
+   void print () const;
+
+private:
+   string sidePath (unsigned side, string const& rel) const {
+      return _root + (side ? "/B/" : "/A/") + rel;
+   }
+   void fill (string const& rel, unsigned which, size_t n, uint64_t offset);
+   int create (string const& full);
+};
+
+//------------------------------------------------------------------------------
+static void fail (char const* call, string const& p) {
+   cerr << "treegen: " << call << ' ' << p << ": " << strerror(errno) << '\n';
+   exit(1);
+}
+
+//------------------------------------------------------------------------------
+static void makeDirs (string const& full) {
+   for (size_t i = full.find('/', 1); ; i = full.find('/', i + 1)) {
+      string part = full.substr(0, i);
+      if (mkdir(part.c_str(), 0777) != 0 && errno != EEXIST) fail("mkdir", part);
+      if (i == string::npos) break;
+   }
+}
+
+//------------------------------------------------------------------------------
+void TreeGen::dir (string const& rel, unsigned which) {
+   for (unsigned side=0; side<2; ++side) {
+      if (which & (1 << side)) makeDirs(sidePath(side, rel));
+   }
+}
+
+//------------------------------------------------------------------------------
+// Fills _buf with n bytes of the file rel at offset. A file in both places has
+// the same contents in each; one on a single side has contents of its own.
+void TreeGen::fill (string const& rel, unsigned which, size_t n, uint64_t offset) {
+   if (_buf.size() < n) _buf.resize(n);
+   uint64_t key = hashOf(rel, _seed ^ which) ^ offset;
+   for (size_t i=0; i<n; i+=8) {
+      uint64_t v = mix(key + i);
+      memcpy(&_buf[i], &v, min<size_t>(8, n - i));
+   }
+}
+
+//------------------------------------------------------------------------------
+int TreeGen::create (string const& full) {
+   int fd = ::open(full.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (fd < 0 && errno == ENOENT) {
+      makeDirs(full.substr(0, full.rfind('/')));
+      fd = ::open(full.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   }
+   if (fd < 0) fail("open", full);
+   return fd;
+}
+
+//------------------------------------------------------------------------------
+void TreeGen::file (string const& rel, size_t size, unsigned which) {
+   static const size_t block = 1 << 20;
+   for (unsigned side=0; side<2; ++side) {
+      if (!(which & (1 << side))) continue;
+      string full = sidePath(side, rel);
+      int fd = create(full);
+      for (size_t off = 0; off < size; off += block) {
+         size_t n = min(block, size - off);
+         fill(rel, which, n, off);
+         if (write(fd, _buf.data(), n) != long(n)) fail("write", full);
+      }
+      ::close(fd);
+      ++_files[side];
+      _bytes[side] += size;
+   }
+}
+
+//------------------------------------------------------------------------------
+// A file of size bytes that's all holes but for extents of 64 KiB spread evenly
+// through it (and one at the very end, so the size is real data).
+void TreeGen::sparseFile (string const& rel, off_t size, unsigned extents, unsigned which) {
+   static const size_t extent = 1 << 16;
+   for (unsigned side=0; side<2; ++side) {
+      if (!(which & (1 << side))) continue;
+      string full = sidePath(side, rel);
+      int fd = create(full);
+      for (unsigned i=0; i<=extents; ++i) {
+         off_t off = i < extents ? size / extents * i : size - extent;
+         fill(rel, which, extent, off);
+         if (pwrite(fd, _buf.data(), extent, off) != long(extent)) fail("pwrite", full);
+      }
+      ::close(fd);
+      ++_files[side];
+      _bytes[side] += size;
+   }
+}
+
+//------------------------------------------------------------------------------
+void TreeGen::print () const {
+   for (unsigned side=0; side<2; ++side) {
+      cout << _root << (side ? "/B: " : "/A: ") << _files[side] << " files, " << _bytes[side] << " bytes\n";
+   }
+}
+
+
+//==============================================================================
+// Shapes
+//==============================================================================
+
+//------------------------------------------------------------------------------
+static string name (char const* prefix, unsigned long n) {
+   return prefix + to_string(n);
+}
+
+//------------------------------------------------------------------------------
+// Directories of 100 small files, two levels deep; a fifth of the directories
+// are only on one side.
+static void tiny (TreeGen& g, unsigned long files, string const& under) {
+   for (unsigned long d = 0; d * 100 < files; ++d) {
+      string dir = under + name("d", d / 100) + '/' + name("e", d % 100);
+      unsigned r = g.below(10);
+      unsigned dirSides = r == 0 ? TreeGen::A : r == 1 ? TreeGen::B : TreeGen::Both;
+      for (unsigned long f = d * 100; f < min(files, (d + 1) * 100); ++f) {
+         unsigned which = dirSides == TreeGen::Both ? g.sides() : dirSides;
+         g.file(dir + '/' + name("f", f), g.below(4097), which);
+      }
+   }
+}
+
+//------------------------------------------------------------------------------
+static void huge (TreeGen& g, unsigned n, size_t bytes, string const& under) {
+   for (unsigned i=0; i<n; ++i) {
+      g.file(under + name("huge", i), bytes, i == 0 ? TreeGen::Both : g.sides());
+   }
+}
+
+//------------------------------------------------------------------------------
+static void wide (TreeGen& g, unsigned long files, string const& under) {
+   for (unsigned long f=0; f<files; ++f) {
+      g.file(under + "wide/" + name("w", f), g.below(1025), g.sides());
+   }
+}
+
+//------------------------------------------------------------------------------
+static void deep (TreeGen& g, unsigned chains, unsigned depth, string const& under) {
+   for (unsigned c=0; c<chains; ++c) {
+      string dir = under + name("chain", c);
+      for (unsigned level=0; level<depth; ++level) {
+         dir += "/d";
+         g.file(dir + "/x", g.below(513), TreeGen::Both);
+         g.file(dir + "/y", g.below(513), g.sides());
+      }
+   }
+}
+
+//------------------------------------------------------------------------------
+static void sparse (TreeGen& g, unsigned n, off_t bytes, string const& under) {
+   for (unsigned i=0; i<n; ++i) {
+      g.sparseFile(under + name("sparse", i), bytes, 16, i == 0 ? TreeGen::Both : g.sides());
+   }
+}
+
+//------------------------------------------------------------------------------
+int main (int argc, char* argv[]) {
+   if (argc < 3) {
+      cerr << "Usage: treegen DIR tiny|huge|wide|deep|sparse|mixed [SCALE [SEED]]\n";
+      return 2;
+   }
+   string root = argv[1];
+   string shape = argv[2];
+   double scale = argc > 3 ? atof(argv[3]) : 1;
+   uint64_t seed = argc > 4 ? strtoull(argv[4], 0, 10) : 1;
+   if (scale <= 0) scale = 1;
+
+   TreeGen g(root, seed);
+   g.dir("", TreeGen::Both);
+   if (shape == "tiny") {
+      tiny(g, 20000 * scale, "");
+   } else if (shape == "huge") {
+      huge(g, 4, size_t((64 << 20) * scale), "");
+   } else if (shape == "wide") {
+      wide(g, 50000 * scale, "");
+   } else if (shape == "deep") {
+      deep(g, 8, min(400u, unsigned(100 * scale)), "");
+   } else if (shape == "sparse") {
+      sparse(g, 8, off_t((1ll << 30) * scale), "");
+   } else if (shape == "mixed") {
+      tiny(g, 2000 * scale, "tiny/");
+      huge(g, 1, size_t((64 << 20) * scale), "huge/");
+      wide(g, 5000 * scale, "");
+      deep(g, 1, min(400u, unsigned(100 * scale)), "deep/");
+      sparse(g, 2, off_t((1ll << 30) * scale), "sparse/");
+   } else {
+      cerr << "treegen: " << shape << " is not a shape (tiny, huge, wide, deep, sparse, or mixed)\n";
+      return 2;
+   }
+   g.print();
+   return 0;
+}
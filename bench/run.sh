@@ -0,0 +1,43 @@
+#!/bin/sh
+#===============================================================================
+# run.sh
+# created October 16, 2026
+#===============================================================================
+#
+# Makes each of treegen's trees, then times a comparison (-o) and a backup
+# (-c -d) of it, appending one JSON line per tree to BENCH_OUT. Each line holds
+# the --stats of both runs, whose phases time recursiveCompare, annotating,
+# copying, and deleting separately. Set BENCH_SCALE (default 1) to make the
+# trees bigger (at 50 the tiny tree has a million files), BENCH_JOBS for -j,
+# BENCH_SHAPES to pick trees, and BENCH_ARGS for any other options. Trees are
+# made under BENCH_DIR, which should be on the filesystem you care about.
+
+set -e
+
+BIN=${BIN:-bin}
+DIR=${BENCH_DIR:-/tmp/backup-bench}
+OUT=${BENCH_OUT:-bench/results.jsonl}
+SCALE=${BENCH_SCALE:-1}
+JOBS=${BENCH_JOBS:-4}
+SHAPES=${BENCH_SHAPES:-"tiny huge wide deep sparse mixed"}
+SEED=${BENCH_SEED:-1}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+mkdir -p "$DIR" "$(dirname "$OUT")"
+for shape in $SHAPES; do
+   tree="$DIR/$shape"
+   rm -rf "$tree"
+   "$BIN/treegen" "$tree" "$shape" "$SCALE" "$SEED"
+   sync
+
+   "$BIN/backup" -j "$JOBS" --progress 0 --stats "$DIR/compare.json" $BENCH_ARGS -o "$tree/A" "$tree/B" > /dev/null
+   "$BIN/backup" -j "$JOBS" --progress 0 --stats "$DIR/backup.json" $BENCH_ARGS -c -d "$tree/A" "$tree/B" > /dev/null
+
+   printf '{"shape": "%s", "scale": %s, "jobs": %s, "seed": %s, "commit": "%s", "date": "%s", "compare": %s, "backup": %s}\n' \
+      "$shape" "$SCALE" "$JOBS" "$SEED" "$COMMIT" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+      "$(tr -d '\n' < "$DIR/compare.json")" "$(tr -d '\n' < "$DIR/backup.json")" >> "$OUT"
+   echo "$shape: compare $(sed -n 's/^  "seconds": //p' "$DIR/compare.json" | tr -d ,)s," \
+        "backup $(sed -n 's/^  "seconds": //p' "$DIR/backup.json" | tr -d ,)s"
+   rm -rf "$tree"
+done
+echo "Results appended to $OUT"
@@ -4,301 +4,1669 @@
 //==============================================================================
 
 #include "Backup.h"
+#include "Metrics.h"
+#include "Throttle.h"
 #include <iomanip>
+#include <sstream>
 #include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+#include <thread>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef __APPLE__
+#define st_atim st_atimespec
+#define st_mtim st_mtimespec
+#endif
 
 using namespace std;
 using namespace boost::filesystem;
 
 
+//------------------------------------------------------------------------------
+// Where a file is written before being renamed over p. It's hidden, so if we're
+// interrupted a later comparison won't mistake it for part of the backup.
+static path tempPath (path const& p) {
+   return p.parent_path() / ("." + p.filename().string() + ".backup-tmp");
+}
+
+//------------------------------------------------------------------------------
+// True if fd has fewer blocks allocated than its size needs, ie. it has holes.
+static bool isSparse (int fd) {
+   struct stat st;
+   return fstat(fd, &st) == 0 && off_t(st.st_blocks) * 512 < st.st_size;
+}
+
+//------------------------------------------------------------------------------
+// The first byte of data in fd at or after off (or end, if there's none before
+// end), setting extentEnd to where that data stops. If the filesystem can't
+// tell us, everything from off to end is data.
+static off_t nextData (int fd, off_t off, off_t end, off_t& extentEnd) {
+   extentEnd = end;
+#ifdef SEEK_DATA
+   off_t data = lseek(fd, off, SEEK_DATA);
+   if (data < 0) return errno == ENXIO ? end : off;
+   if (data >= end) return end;
+   off_t hole = lseek(fd, data, SEEK_HOLE);
+   if (hole > data) extentEnd = min(hole, end);
+   return data;
+#else
+   return off;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Opens full by name within dir if we have dir open, or by its full path if not.
+static int openIn (OpenDirPtr const& dir, path const& full, int flags) {
+   metrics.count(Call::Open);
+   int d = dir ? dir->fd() : -1;
+   return d >= 0 ? openat(d, full.filename().c_str(), flags | O_CLOEXEC, 0666)
+                 : ::open(full.c_str(), flags | O_CLOEXEC, 0666);
+}
+
+//------------------------------------------------------------------------------
+// True if full exists (as anything), looking it up within dir if we can.
+static bool existsIn (OpenDirPtr const& dir, path const& full) {
+   metrics.count(Call::Stat);
+   struct stat st;
+   int d = dir ? dir->fd() : -1;
+   return (d >= 0 ? fstatat(d, full.filename().c_str(), &st, AT_SYMLINK_NOFOLLOW) : lstat(full.c_str(), &st)) == 0;
+}
+
+//------------------------------------------------------------------------------
+// Renames from to to, unless to exists. Returns 0, or -1 with errno set (to
+// EEXIST if to exists).
+static int renameExclusive (path const& from, path const& to) {
+   metrics.count(Call::Rename);
+   int r = -1;
+   errno = ENOSYS;
+#if defined(__linux__) && defined(SYS_renameat2)
+   r = syscall(SYS_renameat2, AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), 1u);  // RENAME_NOREPLACE
+#endif
+   if (r != 0 && (errno == ENOSYS || errno == EINVAL)) {
+      // no renameat2 (or not on this filesystem); a link won't replace anything
+      // either, but directories can't be linked, so for them we look first
+      r = ::link(from.c_str(), to.c_str());
+      if (r == 0) {
+         ::unlink(from.c_str());
+      } else if (errno == EPERM) {
+         struct stat st;
+         if (lstat(to.c_str(), &st) == 0) {
+            errno = EEXIST;
+            return -1;
+         }
+         r = ::rename(from.c_str(), to.c_str());
+      }
+   }
+   return r;
+}
+
+//------------------------------------------------------------------------------
+// Renames from to to. If exclusive, to mustn't exist: then from is removed and
+// we return false.
+static bool moveIntoPlace (path const& from, path const& to, bool exclusive) {
+   if (!exclusive) metrics.count(Call::Rename);
+   int r = exclusive ? renameExclusive(from, to) : ::rename(from.c_str(), to.c_str());
+   if (r == 0) return true;
+   int err = errno;
+   ::unlink(from.c_str());
+   if (err == EEXIST && exclusive) return false;
+   throw filesystem_error("rename", from, to, boost::system::error_code(err, boost::system::system_category()));
+}
+
+//------------------------------------------------------------------------------
+// Syncs the contents of the file (or directory) p.
+static void syncPath (path const& p, bool data) {
+   metrics.count(Call::Sync);
+   int fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC);
+   int r = fd < 0 ? -1 : data ? fdatasync(fd) : fsync(fd);
+   int err = errno;
+   if (fd >= 0) ::close(fd);
+   if (r != 0) {
+      throw filesystem_error(data ? "fdatasync" : "fsync", p, boost::system::error_code(err, boost::system::system_category()));
+   }
+}
+
+//------------------------------------------------------------------------------
+// Gives dst the metadata of src, which had the status st when it was opened
+// (before we read it, which may have changed its atime). Ownership can only be
+// given away by root, so otherwise we settle for the group, or nothing. With
+// xattrs, extended attributes are copied too (ACLs are kept in these), except
+// those we aren't allowed to set. The times go last, after every write. Returns
+// the name of the call that failed (with errno set), or null.
+static char const* copyMetadata (struct stat const& st, int src, int dst, bool xattrs) {
+   metrics.count(Call::Metadata);
+   if (fchown(dst, st.st_uid, st.st_gid) != 0) {
+      if (errno != EPERM) return "fchown";
+      if (fchown(dst, uid_t(-1), st.st_gid) != 0 && errno != EPERM) return "fchown";
+   }
+   if (fchmod(dst, st.st_mode & 07777) != 0) return "fchmod";
+
+#ifdef __linux__
+   if (xattrs) {
+      vector<char> names(1024);
+      long n;
+      while ((n = flistxattr(src, names.data(), names.size())) < 0 && errno == ERANGE) {
+         names.resize(2 * names.size());
+      }
+      if (n < 0 && errno != ENOTSUP) return "flistxattr";
+      vector<char> value(1024);
+      for (long i=0; i<n; i+=strlen(&names[i]) + 1) {
+         char const* name = &names[i];
+         long size;
+         while ((size = fgetxattr(src, name, value.data(), value.size())) < 0 && errno == ERANGE) {
+            value.resize(2 * value.size());
+         }
+         if (size < 0) {
+            if (errno == ENODATA) continue;  // removed since we listed it
+            return "fgetxattr";
+         }
+         if (fsetxattr(dst, name, value.data(), size, 0) != 0 && errno != EPERM && errno != ENOTSUP) {
+            return "fsetxattr";
+         }
+      }
+   }
+#endif
+
+   struct timespec times[2] = { st.st_atim, st.st_mtim };
+   if (futimens(dst, times) != 0) return "futimens";
+   return 0;
+}
+
+//------------------------------------------------------------------------------
+static bool newer (timespec const& a, timespec const& b) {
+   return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
+
+
 //==============================================================================
 // FileCopier (and CopyStatus)
 //==============================================================================
 
 //------------------------------------------------------------------------------
 ostream& operator<< (ostream& os, CopyStatus const& s) {
-   return os << setw(s.fsw) << s.bytes << '/' << setw(s.fsw) << s.totalBytes << " | ";
+   return os << setw(s.fsw) << FileSize(s.bytes.load()) << '/' << setw(s.fsw) << s.totalBytes << (s.scanning ? "+| " : " | ");
 }
    
 //------------------------------------------------------------------------------
-void FileCopier::startBatch (unsigned nFiles, FileSize nBytes) {
-   status.bytes = 0;
-   status.totalBytes = nBytes;
-   status.fileBytes = 0;
-   status.totalFiles = nFiles;
+void CopyStatus::startBatch (unsigned nFiles, FileSize nBytes) {
+   bytes = 0;
+   totalBytes = nBytes;
+   clonedBytes = 0;
+   copiedBytes = 0;
+   matchedBytes = 0;
+   holeBytes = 0;
+   linkedBytes = 0;
+   files = 0;
+   totalFiles = nFiles;
 }
 
 //------------------------------------------------------------------------------
-void FileCopier::copy (path const& srcpath, path const& dstpath, path const& dsppath) {
+// Prints how a batch is coming along every so often (see Reporter) until it's
+// stopped: throughput over the last interval and overall, and unless the totals
+// are still growing, how long the rest should take at the average rate (of
+// files, if byFiles, or else bytes).
+class Progress {
+private:
+   CopyStatus& _status;
+   bool _byFiles;
+   Rate _bytes;
+   Rate _files;
+   Reporter _reporter;
+
+public:
+   Progress (CopyStatus& s, unsigned ms, bool byFiles = false)
+   : _status(s), _byFiles(byFiles), _reporter(chrono::milliseconds(ms), [this] () { print(); }) {}
+   void stop () { _reporter.stop(); }
+
+private:
+   void print ();
+};
+
+//------------------------------------------------------------------------------
+void Progress::print () {
+   FileSize::sizeType bytes = _status.bytes;
+   unsigned files = _status.files;
+   _bytes.sample(bytes);
+   _files.sample(files);
+
+   lock_guard<mutex> lock(_status.out);
+   cout << _status << "... " << FileSize(FileSize::sizeType(_bytes.current)) << "/s, " << long(_files.current + 0.5)
+        << " files/s (average " << FileSize(FileSize::sizeType(_bytes.average)) << "/s, " << long(_files.average + 0.5)
+        << " files/s)";
+   double left = _byFiles ? _files.eta(files, _status.totalFiles) : _bytes.eta(bytes, _status.totalBytes);
+   if (!_status.scanning && left >= 0) cout << ", " << formatSeconds(left) << " left";
+   cout << '\n';
+}
+
+
+//------------------------------------------------------------------------------
+// Adjusts the number of copiers at once, if adaptive, twice a second, and says
+// whenever it changes.
+class Tuner {
+private:
+   CopyStatus& _status;
+   AdaptiveLimit _limit;
+   Reporter _reporter;
+
+public:
+   Tuner (CopyStatus& s, unsigned jobs, double targetMs, path const& source)
+   : _status(s), _limit(jobs, targetMs, deviceOf(source)),
+     _reporter(chrono::milliseconds(_limit.on() ? 500 : 0), [this] () { adjust(); }) {
+      if (targetMs > 0 && !_limit.on()) {
+         cout << "Warning: Can't measure the latency of " << source << "'s device, so copying " << jobs << " at once.\n";
+      }
+   }
+   AdaptiveLimit& limit () { return _limit; }
+   void stop () { _reporter.stop(); }
+
+private:
+   static dev_t deviceOf (path const& p) {
+      struct stat st;
+      return ::stat(p.c_str(), &st) == 0 ? st.st_dev : 0;
+   }
+   void adjust () {
+      if (!_limit.adjust()) return;
+      ostringstream latency;
+      latency << setprecision(3) << _limit.latency();
+      lock_guard<mutex> lock(_status.out);
+      cout << _status << "... copying " << _limit.limit() << " at once (source reads taking " << latency.str() << " ms)\n";
+   }
+};
+
+
+//------------------------------------------------------------------------------
+void SyncBatch::add (path const& temp, path const& dst, path const& dsp, bool exclusive, FileSize::sizeType bytes) {
+   lock_guard<mutex> lock(_m);
+   _pending.push_back(Pending{temp, dst, dsp, exclusive});
+   _bytes += bytes;
+   if (_pending.size() >= max_files || _bytes >= max_bytes) sync();
+}
+
+//------------------------------------------------------------------------------
+void SyncBatch::addDir (path const& dir) {
+   lock_guard<mutex> lock(_m);
+   _dirs.insert(dir);
+}
+
+//------------------------------------------------------------------------------
+void SyncBatch::flush () {
+   lock_guard<mutex> lock(_m);
+   sync();
+}
+
+//------------------------------------------------------------------------------
+// One syncfs writes back every pending file, where a sync per file would wait
+// on the disk once each. The files then take their real names, and last the
+// directories holding those names are synced. (Called holding _m.)
+void SyncBatch::sync () {
+   if (_pending.size()) {
+      path dir = _pending.front().dst.parent_path();
+      metrics.count(Call::Sync);
+#ifdef __linux__
+      int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      int r = fd < 0 ? -1 : syncfs(fd);
+      int err = errno;
+      if (fd >= 0) ::close(fd);
+      if (r != 0) {
+         throw filesystem_error("syncfs", dir, boost::system::error_code(err, boost::system::system_category()));
+      }
+#else
+      ::sync();
+#endif
+      for (Pending const& p : _pending) {
+         if (!moveIntoPlace(p.temp, p.dst, p.exclusive) && existing) existing(p.dsp);
+         _dirs.insert(p.dst.parent_path());
+      }
+      _pending.clear();
+      _bytes = 0;
+   }
+   for (path const& d : _dirs) {
+      syncPath(d, false);
+   }
+   _dirs.clear();
+}
+
+//------------------------------------------------------------------------------
+// Finishes a copy of t, written to target (open as fd), according
+// to durability. Returns false if target is a temporary file and t.dst turned
+// up before it could be renamed into place.
+bool FileCopier::publish (CopyTask const& t, int fd, path const& target) {
+   if (durability == Durability::None) return target == t.dst || moveIntoPlace(target, t.dst, t.exclusive);
+   if (durability == Durability::Batch) {
+#ifdef SYNC_FILE_RANGE_WRITE
+      // start writing back now, so there's less to wait for when the batch syncs
+      sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+      batch->add(target, t.dst, t.dsp, t.exclusive, t.size.bytes);
+      return true;
+   }
+   metrics.count(Call::Sync);
+   if (fdatasync(fd) != 0) {
+      throw filesystem_error("fdatasync", target, boost::system::error_code(errno, boost::system::system_category()));
+   }
+   if (target != t.dst && !moveIntoPlace(target, t.dst, t.exclusive)) return false;
+   batch->addDir(t.dst.parent_path());
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Returns false, having done nothing, if t is exclusive and its destination
+// already exists.
+bool FileCopier::copy (CopyTask const& t) {
+   TraceSpan span("copy file", t.dsp.c_str());
+   throttle.files.take(1);
+
+   // update status
+   file.fileTotal = t.size;
+   file.fileBytes = 0;
+   file.srcPath = t.src;
+   file.dstPath = t.dst;
+   file.dspPath = t.dsp;
+
+   if (safe_mode) {
+      if (t.exclusive && existsIn(t.dir[1], t.dst)) return false;
+      printStart();
+      copyStream(t.src, t.dst);
+   } else {
+      // a temporary file is ours, so it's simply written over; whether the real
+      // one exists is checked first, and again when it's put in place
+      bool temp = t.exclusive && (durability == Durability::Batch || durability == Durability::Atomic);
+      path target = temp ? tempPath(t.dst) : t.dst;
+      if (temp && existsIn(t.dir[1], t.dst)) return false;
+      // the size now, not as scanned, so a file that has grown since is copied whole
+      int src = openIn(t.dir[0], t.src, O_RDONLY);
+      struct stat st;
+      if (src < 0 || fstat(src, &st) != 0) {
+         int err = errno;
+         if (src >= 0) ::close(src);
+         throw filesystem_error("open", t.src, boost::system::error_code(err, boost::system::system_category()));
+      }
+      int dst = openIn(t.dir[1], target, O_WRONLY | O_CREAT | (t.exclusive && !temp ? O_EXCL : O_TRUNC));
+      if (dst < 0) {
+         int err = errno;
+         ::close(src);
+         if (err == EEXIST && t.exclusive) return false;
+         throw filesystem_error("open", target, boost::system::error_code(err, boost::system::system_category()));
+      }
+
+      printStart();
+      bool published = true;
+      try {
+         if (!copyEngine(src, dst, t.src, target, 0, st.st_size, true)) copyStream(t.src, target);
+         if (preserve) {
+            if (char const* call = copyMetadata(st, src, dst, xattrs)) {
+               throw filesystem_error(call, target, boost::system::error_code(errno, boost::system::system_category()));
+            }
+         }
+         if (t.exclusive) published = publish(t, dst, target);
+      } catch (...) {
+         ::close(src);
+         ::close(dst);
+         if (temp) ::unlink(target.c_str());
+         throw;
+      }
+      ::close(src);
+      ::close(dst);
+      if (!published) return false;
+   }
+
+   // count whatever the periodic updates didn't, so the batch total comes out exact
+   if (file.fileTotal.bytes > file.fileBytes.bytes) {
+      status.bytes += file.fileTotal.bytes - file.fileBytes.bytes;
+   }
+   ++status.files;
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Makes t's destination a hard link to original's (an earlier copy of the same
+// data), or with clone a clone of it. If that can't be done (on another
+// filesystem, say, or one that can't clone) t is copied as usual. Returns false,
+// having done nothing, if t's destination already exists.
+bool FileCopier::copyFrom (CopyTask const& t, CopyTask const& original, bool clone) {
+   if (safe_mode) return copy(t);
+   TraceSpan span(clone ? "clone" : "link", t.dsp.c_str());
+   throttle.files.take(1);
+
+   int err = 0;
+   if (!clone) {
+      if (::link(original.dst.c_str(), t.dst.c_str()) != 0) err = errno;
+   } else {
+      int src = ::open(original.dst.c_str(), O_RDONLY | O_CLOEXEC);
+      int dst = src < 0 ? -1 : ::open(t.dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+      if (dst < 0) {
+         err = errno;
+      } else {
+         // the original's metadata is the copy's, but this file's may differ
+         struct stat st;
+         int orig = preserve ? ::open(t.src.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+         if (CloneEngine().transfer(src, dst, 0, t.size.bytes) != long(t.size.bytes) ||
+             (preserve && (orig < 0 || fstat(orig, &st) != 0 || copyMetadata(st, orig, dst, xattrs))) ||
+             (durability != Durability::None && fdatasync(dst) != 0)) {
+            err = errno;
+         }
+         if (orig >= 0) ::close(orig);
+         ::close(dst);
+         if (err) ::unlink(t.dst.c_str());
+      }
+      if (src >= 0) ::close(src);
+   }
+   if (err) return err == EEXIST ? false : copy(t);
+   if (durability != Durability::None && batch) batch->addDir(t.dst.parent_path());
+
+   {
+      lock_guard<mutex> lock(status.out);
+      cout << status << (clone ? "Cloning " : "Linking ") << t.dsp << " to " << original.dsp << '\n';
+   }
+   status.bytes += t.size.bytes;
+   status.linkedBytes += t.size.bytes;
+   ++status.files;
+   return true;
+}
+
+//------------------------------------------------------------------------------
+void FileCopier::copy (path const& srcpath, path const& dstpath, path const& dsppath, FileSize size) {
+   copy(CopyTask{srcpath, dstpath, dsppath, size});
+}
+
+//------------------------------------------------------------------------------
+// Brings dstpath up to date with srcpath by delta transfer. The new file goes to
+// temppath, to be renamed over dstpath by the caller, unless inplace is set and
+// the delta allows dstpath to be patched where it is. A dstpath with other hard
+// links is never patched, since they'd all see the change. Returns true if it
+// was.
+bool FileCopier::copyDelta (path const& srcpath, path const& dstpath, path const& temppath,
+                            path const& dsppath, FileSize size, bool inplace) {
+   TraceSpan span("delta", dsppath.c_str());
+   throttle.files.take(1);
+
+   // update status
+   file.fileTotal = size;
+   file.fileBytes = 0;
+   file.srcPath = srcpath;
+   file.dstPath = dstpath;
+   file.dspPath = dsppath;
+   printStart();
+
+   // open files
+   int src = ::open(srcpath.c_str(), O_RDONLY);
+   struct stat srcst;
+   if (src < 0 || (preserve && fstat(src, &srcst) != 0)) {
+      int err = errno;
+      if (src >= 0) ::close(src);
+      throw filesystem_error("open", srcpath, boost::system::error_code(err, boost::system::system_category()));
+   }
+   int old = ::open(dstpath.c_str(), inplace ? O_RDWR : O_RDONLY);
+   struct stat st;
+   if (old < 0 || fstat(old, &st) != 0) {
+      int err = errno;
+      ::close(src);
+      if (old >= 0) ::close(old);
+      throw filesystem_error("open", dstpath, boost::system::error_code(err, boost::system::system_category()));
+   }
+   int dst = -1;
+   auto fail = [&] (char const* what, path const& p) {
+      int err = errno;
+      ::close(src);
+      ::close(old);
+      if (dst >= 0 && dst != old) ::close(dst);
+      throw filesystem_error(what, p, boost::system::error_code(err, boost::system::system_category()));
+   };
+
+   // find the blocks of dst that are still good, counting progress through src
+   BlockSignatures sig;
+   vector<DeltaOp> ops;
+   if (!sig.compute(old, st.st_size, _bigBuf)) fail("read", dstpath);
+   bool scanned = computeDelta(src, size.bytes, sig, _bigBuf, ops, [&] (off_t n) {
+      file.fileBytes += FileSize(n);
+      status.bytes += n;
+   });
+   if (!scanned) fail("read", srcpath);
+
+   // write the new file
+   bool patch = inplace && st.st_nlink < 2 && deltaInPlace(ops, sig.block_bytes);
+   dst = patch ? old : ::open(temppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (dst < 0) fail("open", temppath);
+   if (!applyDelta(src, old, dst, ops, sig.block_bytes, _bigBuf)) fail("write", patch ? dstpath : temppath);
+   if (preserve) {
+      if (char const* call = copyMetadata(srcst, src, dst, xattrs)) fail(call, patch ? dstpath : temppath);
+   }
+   for (DeltaOp const& op : ops) {
+      (op.block < 0 ? status.copiedBytes : status.matchedBytes) += op.length;
+   }
+
+   ::close(src);
+   ::close(old);
+   if (dst != old) ::close(dst);
+   if (file.fileTotal.bytes > file.fileBytes.bytes) {
+      status.bytes += file.fileTotal.bytes - file.fileBytes.bytes;
+   }
+   ++status.files;
+   return patch;
+}
+
+//------------------------------------------------------------------------------
+// Copies the range [t.begin, t.end) of a file into its (already full size)
+// destination, and counts the file as copied if this was its last chunk. Like
+// copy, returns false if t is exclusive and its destination turned up meanwhile.
+bool FileCopier::copyChunk (CopyTask const& t) {
+   TraceSpan span("copy chunk", t.dsp.c_str());
+
+   // update status
+   file.fileTotal = FileSize::sizeType(t.end - t.begin);
+   file.fileBytes = 0;
+   file.srcPath = t.src;
+   file.dstPath = t.dst;
+   file.dspPath = t.dsp;
+
+   {
+      lock_guard<mutex> lock(status.out);
+      cout << status << "Copying " << t.dsp << " from " << FileSize(FileSize::sizeType(t.begin))
+           << " to " << FileSize(FileSize::sizeType(t.end)) << " of " << t.size << '\n';
+   }
+   int src = openIn(t.dir[0], t.src, O_RDONLY);
+   if (src < 0) {
+      throw filesystem_error("open", t.src, boost::system::error_code(errno, boost::system::system_category()));
+   }
+   path const& target = t.temp.empty() ? t.dst : t.temp;
+   int dst = openIn(t.dir[1], target, O_WRONLY);
+   if (dst < 0) {
+      int err = errno;
+      ::close(src);
+      throw filesystem_error("open", target, boost::system::error_code(err, boost::system::system_category()));
+   }
+   bool published = true;
+   try {
+      if (!copyEngine(src, dst, t.src, target, t.begin, t.end, false)) {
+         copyPread(src, dst, t.src, target, t.begin, t.end);
+      }
+      // the last chunk to finish finishes the file
+      if (--t.chunks->left == 0) {
+         ++status.files;
+         struct stat st;
+         if (preserve) {
+            char const* call = fstat(src, &st) != 0 ? "fstat" : copyMetadata(st, src, dst, xattrs);
+            if (call) {
+               throw filesystem_error(call, target, boost::system::error_code(errno, boost::system::system_category()));
+            }
+         }
+         published = publish(t, dst, target);
+         t.chunks->published = true;
+      }
+   } catch (...) {
+      ::close(src);
+      ::close(dst);
+      throw;
+   }
+   ::close(src);
+   ::close(dst);
+
+   // count whatever the periodic updates didn't, so the batch total comes out exact
+   if (file.fileTotal.bytes > file.fileBytes.bytes) {
+      status.bytes += file.fileTotal.bytes - file.fileBytes.bytes;
+   }
+   return published;
+}
+
+//------------------------------------------------------------------------------
+// Copies [begin, end) of src to dst with the first engine that works. created
+// says dst is a new file, whose size we should set. Returns false (having
+// copied nothing for good) if no engine works.
+bool FileCopier::copyEngine (int src, int dst, path const& srcpath, path const& dstpath,
+                             off_t begin, off_t end, bool created) {
+   if (_engine >= _engines.size()) return false;
+
+   // declare variables
+   off_t off = begin;
+   unsigned e = _engine;
+   bool sparse = isSparse(src);
+   off_t extentEnd = sparse ? begin : end;   // the data from off runs to here
+   FileSize::sizeType holes = 0;             // skipped, but not yet counted
+   bool copied = false;
+   bool shrank = false;
+
+   while (off < end) {
+      if (off >= extentEnd) {
+         off_t data = nextData(src, off, end, extentEnd);
+         holes += data - off;
+         off = data;
+         continue;
+      }
+
+      size_t len = throttle.bytes.portion(min<off_t>(chunk_bytes, extentEnd - off));
+      throttle.bytes.take(len);
+      metrics.count(Call::Transfer);
+      long n = _engines[e]->transfer(src, dst, off, len);
+      if (n < 0) {
+         int err = errno;
+         if (err == EINTR) continue;
+         if (CopyEngine::unsupported(err) && !copied) {
+            // this engine can't do it; the next ones may. If the engine isn't
+            // implemented at all there's no point asking again for later files.
+            if ((err == ENOSYS || err == ENOTTY) && e == _engine) ++_engine;
+            if (++e < _engines.size()) continue;
+            return false;
+         }
+         throw filesystem_error(_engines[e]->name(), srcpath, dstpath,
+                                boost::system::error_code(err, boost::system::system_category()));
+      }
+      if (n == 0) {
+         shrank = true;  // the file shrank while we were copying it
+         break;
+      }
+
+      off += n;
+      copied = true;
+      if (holes) {
+         addHole(holes);
+         holes = 0;
+      }
+      addBytes(n, _engines[e]->clones());
+   }
+   if (holes) addHole(holes);
+
+   // a hole at the end of a new file is made by setting its size
+   if (sparse && !shrank && created && ftruncate(dst, end) != 0) {
+      int err = errno;
+      throw filesystem_error("ftruncate", dstpath, boost::system::error_code(err, boost::system::system_category()));
+   }
+
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Copies [begin, end) of src to dst through _bigBuf, for chunks no engine will take.
+void FileCopier::copyPread (int src, int dst, path const& srcpath, path const& dstpath, off_t begin, off_t end) {
+   if (_bigBuf.size() < (1 << 20)) _bigBuf.resize(1 << 20);
+
+   off_t extentEnd = isSparse(src) ? begin : end;
+   for (off_t off = begin; off < end; ) {
+      if (off >= extentEnd) {
+         off_t data = nextData(src, off, end, extentEnd);
+         if (data > off) addHole(data - off);
+         off = data;
+         continue;
+      }
+      size_t len = min<off_t>(_bigBuf.size(), extentEnd - off);
+      throttle.bytes.take(len);
+      metrics.count(Call::Transfer);
+      long n = pread(src, _bigBuf.data(), len, off);
+      for (long w = 0; n > 0 && w < n; ) {
+         long m = pwrite(dst, _bigBuf.data() + w, n - w, off + w);
+         if (m < 0 && errno == EINTR) continue;
+         if (m <= 0) {
+            // writing nothing at all would have us try forever; take it as a full disk
+            int err = m < 0 ? errno : ENOSPC;
+            throw filesystem_error("pwrite", dstpath, boost::system::error_code(err, boost::system::system_category()));
+         }
+         w += m;
+      }
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         int err = errno;
+         throw filesystem_error("pread", srcpath, boost::system::error_code(err, boost::system::system_category()));
+      }
+      if (n == 0) break;  // the file shrank while we were copying it
+
+      off += n;
+      addBytes(n, false);
+   }
+
+}
+
+//------------------------------------------------------------------------------
+void FileCopier::copyStream (path const& srcpath, path const& dstpath) {
    // declare variables
-   long unsigned buf_count = 0;
-   long unsigned buf_trigger = bufs_per_update;
-   FileSize initialBytes = status.bytes;
+   if (buf.empty()) buf.resize(BUFSIZ);
+
+   // open files
+   std::ifstream src(srcpath.c_str(), ios_base::in | ios_base::binary);
+   std::ofstream dst;
+   if (!safe_mode) dst.open(dstpath.c_str(), ios_base::out | ios_base::binary);
+
+   while (src) {
+      throttle.bytes.take(buf.size());
+      src.read(buf.data(), buf.size());
+      if (!safe_mode) dst.write(buf.data(), src.gcount());
+      addBytes(src.gcount(), false);
+   }
+
+   src.close();
+   if (!safe_mode) dst.close();
+   if (file.fileTotal.bytes > file.fileBytes.bytes) {
+      status.copiedBytes += file.fileTotal.bytes - file.fileBytes.bytes;
+   }
+}
+
+//------------------------------------------------------------------------------
+void FileCopier::addBytes (FileSize::sizeType n, bool cloned) {
+   file.fileBytes += FileSize(n);
+   status.bytes += n;
+   if (cloned) {
+      status.clonedBytes += n;
+   } else {
+      status.copiedBytes += n;
+   }
+}
+
+//------------------------------------------------------------------------------
+void FileCopier::addHole (FileSize::sizeType n) {
+   file.fileBytes += FileSize(n);
+   status.bytes += n;
+   status.holeBytes += n;
+}
+
+//------------------------------------------------------------------------------
+void FileCopier::printStart () const {
+   lock_guard<mutex> lock(status.out);
+   cout << status << "Copying " << file.dspPath << " (" << file.fileTotal << ')' << '\n';
+}
+
+//------------------------------------------------------------------------------
+ChunkedFile::~ChunkedFile () {
+   if (!published) ::unlink(temp.c_str());
+}
+
+
+//------------------------------------------------------------------------------
+static bool bySize (CopyTask const& a, CopyTask const& b) {
+   return a.size.bytes < b.size.bytes;
+}
+
+//------------------------------------------------------------------------------
+void CopyQueue::push (CopyTask const& t) {
+   unique_lock<mutex> lock(_m);
+   if (capacity) {
+      _changed.wait(lock, [&] () { return _cancelled || _large.size() + _small.size() < capacity; });
+      if (_cancelled) return;
+   }
+   if (!t.chunks && t.size.bytes >= large_bytes) {
+      // once started, the large files are kept in order as they come
+      _large.insert(_open ? upper_bound(_large.begin(), _large.end(), t, bySize) : _large.end(), t);
+   } else {
+      _small.push_back(t);
+   }
+   _changed.notify_all();
+}
+
+//------------------------------------------------------------------------------
+void CopyQueue::start (unsigned jobs, bool streaming) {
+   lock_guard<mutex> lock(_m);
+   sort(_large.begin(), _large.end(), bySize);
+   _largeWorkers = 0;
+   _maxLarge = jobs > 1 ? jobs / 2 : 1;
+   _open = streaming;
+   _cancelled = false;
+}
+
+//------------------------------------------------------------------------------
+void CopyQueue::close () {
+   lock_guard<mutex> lock(_m);
+   _open = false;
+   _changed.notify_all();
+}
+
+//------------------------------------------------------------------------------
+// Returns false once there's nothing left to do (waiting, if the queue is still
+// open, for something to come along).
+bool CopyQueue::pop (CopyTask& t, bool& large) {
+   unique_lock<mutex> lock(_m);
+   while (!_cancelled) {
+      bool haveSmall = _small.size();
+      if (_large.size() && (_largeWorkers < _maxLarge || !haveSmall)) {
+         t = std::move(_large.back());
+         _large.pop_back();
+         ++_largeWorkers;
+         large = true;
+         _changed.notify_all();
+         return true;
+      }
+      if (haveSmall) {
+         t = std::move(_small.front());
+         _small.pop_front();
+         large = false;
+         _changed.notify_all();
+         return true;
+      }
+      if (!_open) return false;
+      _changed.wait(lock);
+   }
+   return false;
+}
+
+//------------------------------------------------------------------------------
+void CopyQueue::done (bool large) {
+   lock_guard<mutex> lock(_m);
+   if (large) --_largeWorkers;
+}
+
+//------------------------------------------------------------------------------
+void CopyQueue::cancel () {
+   lock_guard<mutex> lock(_m);
+   _cancelled = true;
+   _changed.notify_all();
+}
+
+
+//==============================================================================
+// Modified Vectors (FileVector, DirVector, and FDPair)
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Tallies up the number of files and bytes of children of the DirVector's
+// contents, recording each of them in the manifest along the way.
+template <typename Func>
+void DirVector::annotate (Func grounder) {
+   _files = 0;
+   _bytes = 0;
+   _manifest.clear();
+   _ends.clear();
+
+   // a directory is only scanned after the scan that found it, so its contents
+   // always follow it in the manifest. Each is opened by name in its parent.
+   vector<pair<RelPath, OpenDirPtr>> todo;
+   vector<Entry> entries;
+   for (unsigned i=0; i<size(); ++i) {
+      RelPath top = FileVector::operator[](i).path;
+      todo.emplace_back(top, make_shared<OpenDir>(grounder(top)));
+      while (todo.size()) {
+         RelPath dir = todo.back().first;
+         OpenDirPtr open = std::move(todo.back().second);
+         todo.pop_back();
+         entries.clear();
+         scanDirectory(*open, grounder(dir), dir, false, _names, entries);
+
+         for (Entry& e : entries) {
+            if (e.isDir()) todo.emplace_back(e.path, make_shared<OpenDir>(open, e.path.filename()));
+            if (e.isFile()) {
+               ++_files;
+               _bytes += e.size;
+            }
+            _manifest.push_back(e);
+         }
+      }
+      _ends.push_back(_manifest.size());
+   }
+}
+
+//------------------------------------------------------------------------------
+template <typename Pred>
+void DirVector::removeIf (Pred gone) {
+   vector<Entry> dirs;
+   vector<Entry> manifest;
+   vector<size_t> ends;
+   _files = 0;
+   _bytes = 0;
+   for (unsigned i=0; i<size(); ++i) {
+      Entry const& d = (*this)[i];
+      if (gone(d)) continue;
+      dirs.push_back(d);
+      for (size_t j=manifestBegin(i); j<manifestEnd(i); ++j) {
+         Entry const& e = _manifest[j];
+         if (gone(e)) continue;
+         if (e.isFile()) {
+            ++_files;
+            _bytes += e.size;
+         }
+         manifest.push_back(e);
+      }
+      ends.push_back(manifest.size());
+   }
+   std::vector<Entry>::swap(dirs);
+   _manifest.swap(manifest);
+   _ends.swap(ends);
+}
+
+//------------------------------------------------------------------------------
+void FDPair::fprint () const {
+   cout << f.size() << " files totaling " << fbytes() << '.' << '\n';
+   for (unsigned i=0; i<f.size(); ++i) {
+      cout << "  * " << f[i].path << '\n';
+   }
+   cout << '\n';
+}
+
+//------------------------------------------------------------------------------
+void FDPair::dprint () const {
+   cout << d.size() << " directories, containing " << dfiles() << " files (" << dbytes() << ")." << '\n';
+   for (unsigned i=0; i<d.size(); ++i) {
+      cout << "  * " << d[i].path << '\n';
+   }
+   cout << '\n';
+}
+
+//------------------------------------------------------------------------------
+void FDPair::print () const {
+   fprint();
+   dprint();
+}
+
+
+//==============================================================================
+// DirectoryComparer
+//==============================================================================
+
+//------------------------------------------------------------------------------
+void DirectoryComparer::outline () {
+   recursiveCompare();
+   if (verify_mode) verify();
+   annotate0();
+   annotate1();
+   annotateMutual();
+   printOutline();
+}
+
+//------------------------------------------------------------------------------
+void DirectoryComparer::status (bool p0, bool p1, bool ps, bool pi) {
+   recursiveCompare();
+   if (verify_mode) verify();
+   if (p0) {
+      annotate0();
+      print0();
+   }
+   if (p0 && update_mode) {
+      printModified();
+   }
+   if (p1) {
+      annotate1();
+      print1();
+   }
+   if (ps) {
+      annotateMutual();
+      printShared();
+   }
+   if (pi) {
+      printIssues();
+   }
+}
+
+//------------------------------------------------------------------------------
+void DirectoryComparer::backup (bool c, bool d) {
+   if (stream_mode && !verify_mode) {
+      stream(c, d);
+   } else {
+      recursiveCompare();
+      if (verify_mode) verify();
+      if (c && d && move_mode) moves();
+      if (d && delete_first) del();
+      if (c) copy();
+      if (c && update_mode) update();
+      if (d && !delete_first) del();
+   }
+   fixDirectories();
+}
+
+//------------------------------------------------------------------------------
+// Compares the directories _p[0] / t.ext and _p[1] / t.ext, adding what it finds
+// to c. Shared subdirectories are left in c.sc.d for the caller to explore.
+void DirectoryComparer::compare (DirTask const& t, Comparison& c) const {
+   RelPath const& ext = t.ext;
+
+   // clear temp vecs
+   vector<Entry>& temp1 = c.temp1;
+   vector<Entry>& temp2 = c.temp2;
+   temp1.clear();
+   temp2.clear();
+
+   // fill temp vecs (one stat per entry, and that's the last we'll need)
+   Entry self[2];
+   scanDirectory(*t.dir[0], groundPath(ext, 0), ext, ignore_hidden_files, c.names, temp1, self);
+   scanDirectory(*t.dir[1], groundPath(ext, 1), ext, ignore_hidden_files, c.names, temp2, self + 1);
+
+   // remember how much we'd found, so we can tell what this directory adds
+   size_t found = c.uc[0].f.size() + c.uc[0].d.size() + c.uc[1].f.size() + c.uc[1].d.size() +
+                  c.sizeIssues.size() + c.fdIssues.size() + c.modified.size();
+   size_t sharedFiles = c.sc.f.size();
+   FileSize sharedBytes = c.sc.f.bytes();
+
+   // sort temp vecs
+   sortByName(temp1);
+   sortByName(temp2);
+
+   // compare temp vecs
+   vector<Entry>::iterator itr1 = temp1.begin();
+   vector<Entry>::iterator end1 = temp1.end();
+   vector<Entry>::iterator itr2 = temp2.begin();
+   vector<Entry>::iterator end2 = temp2.end();
+   while (itr1 != end1 && itr2 != end2) {
+      int order = itr1->path.compareName(itr2->path);
+
+      // if the names are the same
+      if (order == 0) {
+         // relative path is the same for both directories
+         itr2->path = itr1->path;
+
+         // links are left alone, but not quietly if the other side isn't one
+         if (itr1->isLink() || itr2->isLink()) {
+            if (itr1->type != itr2->type) c.fdIssues.push_back(EntryPair(*itr1, *itr2));
+
+         // *itr1 is a file
+         } else if (itr1->isFile()) {
+            // *itr1 is file, *itr2 is file
+            if (itr2->isFile()) {
+               // test that filesizes match
+               if (itr1->size.bytes == itr2->size.bytes) {
+                  // Note that file content may still differ! When verifying
+                  // it's checked later; otherwise in update mode we go by mtime.
+                  if (update_mode && !verify_mode && newer(itr1->mtime, itr2->mtime)) {
+                     c.modified.push_back(EntryPair(*itr1, *itr2));
+                  } else {
+                     c.sc.f.push_back(*itr1);
+                     c.sc1.push_back(*itr2);
+                  }
+               } else if (update_mode) {
+                  c.modified.push_back(EntryPair(*itr1, *itr2));
+               } else {
+                  c.sizeIssues.push_back(EntryPair(*itr1, *itr2));
+               }
+            // *itr1 is file, *itr2 is not
+            } else {
+               c.fdIssues.push_back(EntryPair(*itr1, *itr2));
+            }
+         // *itr1 is a dir
+         } else {
+            // *itr1 is dir, *itr2 is dir
+            if (itr2->isDir()) {
+               // Note that directory contents may still differ;
+               // we will address this later.
+               c.sc.d.push_back(*itr1);
+            // *itr1 is dir, *itr2 is not
+            } else {
+               c.fdIssues.push_back(EntryPair(*itr1, *itr2));
+            }
+         }
+         // advance
+         ++itr1;
+         ++itr2;
+
+      // if *itr1 comes first, it is unique to dir1
+      } else if (order < 0) {
+            c.uc[0].add(*itr1);
+         ++itr1;
+
+      // if *itr2 comes first, it is unique to dir2
+      } else {
+            c.uc[1].add(*itr2);
+         ++itr2;
+      }
+   }
+
+   // all remaining contents are unique
+   // (only one of these while loop blocks ever executes)
+   while (itr1 != end1) {
+      c.uc[0].add(*itr1);
+      ++itr1;
+   }
+   while (itr2 != end2) {
+      c.uc[1].add(*itr2);
+      ++itr2;
+   }
+
+   // record this directory for the catalog
+   if (catalog_file.size()) {
+      CatalogEntry d;
+      d.path = ext.string();
+      d.mtime[0] = self[0].mtime;
+      d.mtime[1] = self[1].mtime;
+      d.files = c.sc.f.size() - sharedFiles;
+      d.bytes = c.sc.f.bytes().bytes - sharedBytes.bytes;
+      d.clean = found == c.uc[0].f.size() + c.uc[0].d.size() + c.uc[1].f.size() + c.uc[1].d.size() +
+                         c.sizeIssues.size() + c.fdIssues.size() + c.modified.size();
+      c.dirs.push_back(d);
+   }
+}
+
+//------------------------------------------------------------------------------
+// Finds out which subtrees haven't changed since last time.
+void DirectoryComparer::openCatalog () {
+   if (catalog_file.size() && !verify_mode && !update_mode) {
+      _catalog.reset(new Catalog());
+      if (_catalog->open(catalog_file, _p[0], _p[1])) {
+         _catalog->check(_p[0], _p[1], jobs);
+      } else {
+         _catalog.reset();
+      }
+   }
+}
+
+//------------------------------------------------------------------------------
+// True if the catalog says t's subtree is unchanged, in which case its records
+// are carried over into c.
+bool DirectoryComparer::skipCatalogued (DirTask const& t, Comparison& c) const {
+   size_t skipped = c.dirs.size();
+   if (!_catalog || !_catalog->skip(t.ext, c.dirs)) return false;
+   for (size_t i=skipped; i<c.dirs.size(); ++i) {
+      c.skippedFiles += c.dirs[i].files;
+      c.skippedBytes += FileSize::sizeType(c.dirs[i].bytes);
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Writes out what's backed up now (the records merged into _dirs).
+void DirectoryComparer::closeCatalog () {
+   _catalog.reset();
+   if (catalog_file.size() && !safe_mode) {
+      Catalog::write(catalog_file, _p[0], _p[1], _dirs);
+   }
+}
+
+//------------------------------------------------------------------------------
+void DirectoryComparer::recursiveCompare () {
+   PhaseTimer timer(Phase::Compare);
+   if (!(_annotations & RC)) {
+      _annotations = 0;
+      vector<Comparison> found(jobs);
+      WorkStealingQueues<DirTask> queues(jobs);
+      queues.push(0, DirTask{ RelPath(), { make_shared<OpenDir>(_p[0]), make_shared<OpenDir>(_p[1]) } });
+      openCatalog();
+
+      runWorkers(jobs, [&] (unsigned id) {
+         Comparison& c = found[id];
+         DirTask t;
+         while (queues.pop(id, t)) {
+            if (skipCatalogued(t, c)) {
+               queues.done();
+               continue;
+            }
+            compare(t, c);
+            for (Entry const& d : c.sc.d) {
+               path name = d.path.filename();
+               queues.push(id, DirTask{ d.path, { make_shared<OpenDir>(t.dir[0], name),
+                                                  make_shared<OpenDir>(t.dir[1], name) } });
+            }
+            c.sc.d.clear();
+            t = DirTask();  // so this directory is closed once its subdirectories are open
+            queues.done();
+         }
+      }, [&] () { queues.cancel(); });
+
+      for (Comparison& c : found) {
+         merge(c);
+      }
+      closeCatalog();
+      _extension = "";
+      _annotations |= RC;
+   }
+}
+
+//------------------------------------------------------------------------------
+void DirectoryComparer::merge (Comparison& c) {
+   _names.append(c.names);
+   _uc[0].append(c.uc[0]);
+   _uc[1].append(c.uc[1]);
+   _sc.append(c.sc);
+   _sc1.append(c.sc1);
+   _sizeIssues.insert(_sizeIssues.end(), c.sizeIssues.begin(), c.sizeIssues.end());
+   _fdIssues.insert(_fdIssues.end(), c.fdIssues.begin(), c.fdIssues.end());
+   _modified.insert(_modified.end(), c.modified.begin(), c.modified.end());
+   c.sizeIssues.clear();
+   c.fdIssues.clear();
+   c.modified.clear();
+   _dirs.insert(_dirs.end(), c.dirs.begin(), c.dirs.end());
+   c.dirs.clear();
+   _skippedFiles += c.skippedFiles;
+   _skippedBytes += c.skippedBytes;
+}
+
+//------------------------------------------------------------------------------
+// Hashes every shared file in A and in B, and moves those whose hashes differ
+// to _contentIssues (or to _modified, in update mode). Each side of each file is a separate task, and consecutive
+// tasks are the two sides of the same file, so with two or more jobs A and B
+// are read at the same time. Hashes are looked up in (and added to) the cache
+// by device, inode, size, and mtime, so unchanged files are only read once.
+void DirectoryComparer::verify () {
+   PhaseTimer timer(Phase::Verify);
+   if (_annotations & VF) return;
+
+   HashCache cache;
+   if (hash_cache_file.size()) cache.load(hash_cache_file);
+
+   size_t n = _sc.f.size();
+   cout << "========== Verifying Shared Files ==========\n";
+   cout << "Verifying " << n << " files totaling " << _sc.f.bytes() << " in both "
+        << _p[0] << " and " << _p[1] << ".\n";
+
+   vector<uint64_t> hashes(2 * n);
+   atomic<size_t> next(0);
+   atomic<unsigned> cached(0);
+   runWorkers(jobs, [&] (unsigned) {
+      vector<char> buf;
+      for (size_t t = next++; t < 2 * n; t = next++) {
+         unsigned side = t & 1;
+         Entry const& e = side ? _sc1[t / 2] : _sc.f[t / 2];
+         HashKey k = { e.dev, e.ino, e.size.bytes, e.mtime.tv_sec, e.mtime.tv_nsec };
+         if (cache.find(k, hashes[t])) {
+            ++cached;
+         } else {
+            hashes[t] = hashFile(groundPath(e.path, side), buf);
+            cache.insert(k, hashes[t]);
+         }
+      }
+   }, [&] () { next = 2 * n; });
+
+   // keep only the files whose contents match
+   FileVector same0;
+   FileVector same1;
+   size_t differ = 0;
+   for (size_t i=0; i<n; ++i) {
+      if (hashes[2 * i] == hashes[2 * i + 1]) {
+         same0.push_back(_sc.f[i]);
+         same1.push_back(_sc1[i]);
+      } else {
+         (update_mode ? _modified : _contentIssues).push_back(EntryPair(_sc.f[i], _sc1[i]));
+         ++differ;
+      }
+   }
+   swap(_sc.f, same0);
+   swap(_sc1, same1);
+
+   cout << cached << " of " << 2 * n << " hashes were cached. "
+        << differ << " files differ in content.\n\n";
+   if (hash_cache_file.size() && !safe_mode) cache.save(hash_cache_file);
+   _annotations |= VF;
+}
+
+//------------------------------------------------------------------------------
+// Looks for the files unique to A among those unique to B, and moves any it
+// finds within B to where they are in A, so they're neither copied again nor
+// deleted. Files are paired by size, then by hashing samples of them, and then
+// unless their mtimes match too (as they will if the copy was made in preserve
+// mode) by hashing the whole of each. Small files aren't worth the trouble. A
+// directory unique to A is moved whole from one unique to B if everything in
+// them is at the same places, and their files all pair up.
+void DirectoryComparer::moves () {
+   PhaseTimer timer(Phase::Moves);
+   annotate0();
+   annotate1();
+   DirVector const* d[2] = { &_uc[0].d, &_uc[1].d };
+
+   // each side's unique files, and the unique directories they're in
+   struct Candidate {
+      Entry const* e;
+      int top;          // in *d[side], or -1
+      uint64_t sample;
+      uint64_t hash;    // of the whole file, or 0 if not needed yet
+      bool paired;
+   };
+   vector<Candidate> found[2];
+   vector<unsigned> large[2];        // files we look for, in each unique directory
+   for (unsigned n=0; n<2; ++n) {
+      large[n].resize(d[n]->size());
+      for (Entry const& e : _uc[n].f) {
+         if (e.size.bytes >= move_bytes) found[n].push_back(Candidate{&e, -1, 0, 0, false});
+      }
+      for (unsigned i=0; i<d[n]->size(); ++i) {
+         for (size_t j=d[n]->manifestBegin(i); j<d[n]->manifestEnd(i); ++j) {
+            Entry const& e = d[n]->manifest()[j];
+            if (!e.isFile() || e.size.bytes < move_bytes) continue;
+            found[n].push_back(Candidate{&e, int(i), 0, 0, false});
+            ++large[n][i];
+         }
+      }
+   }
+
+   // only files whose size turns up on both sides need sampling
+   unordered_map<FileSize::sizeType, vector<size_t>> bySize;
+   for (size_t j=0; j<found[1].size(); ++j) {
+      bySize[found[1][j].e->size.bytes].push_back(j);
+   }
+   vector<Candidate*> toSample;
+   vector<unsigned> sides;
+   vector<char> sampled(found[1].size());
+   for (Candidate& a : found[0]) {
+      auto itr = bySize.find(a.e->size.bytes);
+      if (itr == bySize.end()) continue;
+      toSample.push_back(&a);
+      sides.push_back(0);
+      for (size_t j : itr->second) {
+         if (sampled[j]) continue;
+         sampled[j] = 1;
+         toSample.push_back(&found[1][j]);
+         sides.push_back(1);
+      }
+   }
+   if (toSample.empty()) return;
+
+   cout << "========== Looking for Moved Files ==========\n";
+   cout << "Sampling " << toSample.size() << " files that might have been moved.\n";
+   atomic<size_t> next(0);
+   runWorkers(jobs, [&] (unsigned) {
+      vector<char> buf;
+      for (size_t t = next++; t < toSample.size(); t = next++) {
+         Candidate& c = *toSample[t];
+         c.sample = hashSample(groundPath(c.e->path, sides[t]), c.e->size.bytes, buf);
+      }
+   }, [&] () { next = toSample.size(); });
 
-   // update status
-   status.fileTotal = file_size(srcpath);
-   status.srcPath = srcpath;
-   status.dstPath = dstpath;
-   status.dspPath = dsppath;
+   // pair them up, trying files of the same name first (the likeliest moves)
+   vector<char> buf;
+   auto same = [&] (Entry const& a, Entry const& b, uint64_t* ha, uint64_t* hb) {
+      if (a.mtime.tv_sec == b.mtime.tv_sec && a.mtime.tv_nsec == b.mtime.tv_nsec) return true;
+      uint64_t h[2];
+      if (!ha) ha = h;
+      if (!hb) hb = h + 1;
+      if (!*ha) *ha = hashFile(groundPath(a.path, 0), buf) | 1;
+      if (!*hb) *hb = hashFile(groundPath(b.path, 1), buf) | 1;
+      return *ha == *hb;
+   };
+   vector<pair<size_t, size_t>> pairs;
+   for (size_t i=0; i<found[0].size(); ++i) {
+      Candidate& a = found[0][i];
+      auto itr = bySize.find(a.e->size.bytes);
+      if (itr == bySize.end()) continue;
+      for (int byName=1; byName>=0 && !a.paired; --byName) {
+         for (size_t j : itr->second) {
+            Candidate& b = found[1][j];
+            if (b.paired || b.sample != a.sample || (a.e->path.compareName(b.e->path) == 0) != bool(byName)) continue;
+            if (same(*a.e, *b.e, &a.hash, &b.hash)) {
+               a.paired = b.paired = true;
+               pairs.emplace_back(i, j);
+               break;
+            }
+         }
+      }
+   }
 
-   // open files
-   ifstream src(srcpath.c_str());
-   ofstream dst;
-   if (!safe_mode) dst.open(dstpath.c_str(), ios_base::out | ios_base::binary);
+   // where a file is within its unique directory
+   auto inside = [&] (unsigned n, Entry const& e, int top) {
+      return e.path.string().substr((*d[n])[top].path.string().size() + 1);
+   };
 
-   printStart(status);
-   while (src) {
-      if (buf_count++ == buf_trigger) {
-         buf_trigger += bufs_per_update;
-         FileSize newbytes = bufs_per_update * BUFSIZ;
-         status.bytes += newbytes;
-         status.fileBytes += newbytes;
-         printUpdate(status);
+   // directories whose files all paired up with each other's
+   map<pair<int, int>, unsigned> together;
+   for (auto const& p : pairs) {
+      Candidate const& a = found[0][p.first];
+      Candidate const& b = found[1][p.second];
+      if (a.top >= 0 && b.top >= 0 && inside(0, *a.e, a.top) == inside(1, *b.e, b.top)) {
+         ++together[make_pair(a.top, b.top)];
       }
+   }
+   vector<char> whole[2] = { vector<char>(d[0]->size()), vector<char>(d[1]->size()) };
+   vector<pair<int, int>> dirMoves;
+   for (auto const& t : together) {
+      int i = t.first.first;
+      int j = t.first.second;
+      if (whole[0][i] || whole[1][j] || t.second != large[0][i] || t.second != large[1][j]) continue;
 
-      src.read(buf, BUFSIZ);
-      if (!safe_mode) dst.write(buf, src.gcount());
+      // and everything else in them must be the same too
+      size_t n = d[0]->manifestEnd(i) - d[0]->manifestBegin(i);
+      if (n != d[1]->manifestEnd(j) - d[1]->manifestBegin(j)) continue;
+      map<string, Entry const*> rest;
+      for (size_t k=d[1]->manifestBegin(j); k<d[1]->manifestEnd(j); ++k) {
+         Entry const& e = d[1]->manifest()[k];
+         rest[inside(1, e, j)] = &e;
+      }
+      bool match = true;
+      for (size_t k=d[0]->manifestBegin(i); k<d[0]->manifestEnd(i) && match; ++k) {
+         Entry const& e = d[0]->manifest()[k];
+         auto itr = rest.find(inside(0, e, i));
+         match = itr != rest.end() && itr->second->type == e.type && itr->second->size.bytes == e.size.bytes &&
+                 (!e.isFile() || e.size.bytes >= move_bytes || same(e, *itr->second, 0, 0));
+      }
+      if (match) {
+         whole[0][i] = whole[1][j] = 1;
+         dirMoves.emplace_back(i, j);
+      }
    }
 
-   src.close();
-   if (!safe_mode) dst.close();
-   status.bytes = initialBytes + status.fileTotal;
-}
+   // move them
+   unordered_set<string> gone[2];   // what's no longer unique to either side
+   unsigned files = 0;
+   unsigned singles = 0;
+   FileSize bytes(0);
+   auto move = [&] (RelPath const& from, RelPath const& to) {
+      cout << "Moving " << from << " to " << to << ".\n";
+      gone[0].insert(to.string());
+      gone[1].insert(from.string());
+      if (safe_mode) return;
+      path target = groundPath(to, 1);
+      create_directories(target.parent_path());
+      if (renameExclusive(groundPath(from, 1), target) != 0) {
+         throw filesystem_error("rename", groundPath(from, 1), target, boost::system::error_code(errno, boost::system::system_category()));
+      }
+      touch(from.parent_path());
+      touch(to.parent_path());
+   };
+   for (auto const& m : dirMoves) {
+      move((*d[1])[m.second].path, (*d[0])[m.first].path);
+      for (size_t k=d[0]->manifestBegin(m.first); k<d[0]->manifestEnd(m.first); ++k) {
+         Entry const& e = d[0]->manifest()[k];
+         if (!e.isFile()) continue;
+         ++files;
+         bytes += e.size;
+      }
+   }
+   for (auto const& p : pairs) {
+      Candidate const& a = found[0][p.first];
+      if (a.top >= 0 && whole[0][a.top]) continue;
+      move(found[1][p.second].e->path, a.e->path);
+      ++singles;
+      ++files;
+      bytes += a.e->size;
+   }
 
-//------------------------------------------------------------------------------
-void FileCopier::printStart (CopyStatus const& s) const {
-   cout << s << "Copying " << s.dspPath << " (" << s.fileTotal << ')' << '\n';
+   // and forget them
+   for (unsigned n=0; n<2; ++n) {
+      auto isGone = [&] (Entry const& e) { return gone[n].count(e.path.string()) > 0; };
+      _uc[n].f.removeIf(isGone);
+      _uc[n].d.removeIf(isGone);
+   }
+   cout << "Moved " << files << " files (" << bytes << "): " << dirMoves.size() << " directories and "
+        << singles << " single files.\n\n";
 }
 
 //------------------------------------------------------------------------------
-void FileCopier::printUpdate (CopyStatus const& s) const {
-   cout << s << "... " << s.fileBytes << '/' << s.fileTotal << '\n';
+void DirectoryComparer::annotate0 () {
+   if (!(_annotations & A0)) {
+      PhaseTimer timer(Phase::Annotate);
+      _uc[0].d.annotate([this] (RelPath const& p) { return groundPath(p, 0); });
+      _annotations |= A0;
+   }
 }
 
-
-//==============================================================================
-// Modified Vectors (FileVector, DirVector, and FDPair)
-//==============================================================================
-
 //------------------------------------------------------------------------------
-// Tallies up the number of files and bytes of children of the DirVector's contents.
-template <typename Func>
-void DirVector::annotate (Func grounder) {
-   _files = 0;
-   _bytes = 0;
-   for (unsigned i=0; i<size(); ++i) {
-      recursive_directory_iterator itr(grounder(FileVector::operator[](i)));
-      recursive_directory_iterator end;
-      while (itr != end) {
-         if (is_regular_file(itr->path())) {
-            ++_files;
-            _bytes += file_size(itr->path());
-         }
-         ++itr;
-      }
+void DirectoryComparer::annotate1 () {
+   if (!(_annotations & A1)) {
+      PhaseTimer timer(Phase::Annotate);
+      _uc[1].d.annotate([this] (RelPath const& p) { return groundPath(p, 1); });
+      _annotations |= A1;
    }
 }
 
-
 //------------------------------------------------------------------------------
-void FDPair::fprint () const {
-   cout << f.size() << " files totaling " << fbytes() << '.' << '\n';
-   for (unsigned i=0; i<f.size(); ++i) {
-      cout << "  * " << f[i] << '\n';
+void DirectoryComparer::annotateMutual () {
+   if (!(_annotations & AM)) {
+      PhaseTimer timer(Phase::Annotate);
+      _sc.d.annotate([this] (RelPath const& p) { return groundPath(p, 0); });
+      _annotations |= AM;
    }
-   cout << '\n';
 }
 
 //------------------------------------------------------------------------------
-void FDPair::dprint () const {
-   cout << d.size() << " directories, containing " << dfiles() << " files (" << dbytes() << ")." << '\n';
-   for (unsigned i=0; i<d.size(); ++i) {
-      cout << "  * " << d[i] << '\n';
-   }
-   cout << '\n';
+// Sets copier up to copy the way we've been asked to.
+void DirectoryComparer::prepare (FileCopier& copier, SyncBatch& batch) const {
+   copier.setEngine(copy_engine, clone_mode, engine_options);
+   copier.durability = durability;
+   copier.batch = &batch;
+   copier.preserve = preserve_mode;
+   copier.xattrs = xattr_mode;
 }
 
 //------------------------------------------------------------------------------
-void FDPair::print () const {
-   fprint();
-   dprint();
+// Notes that we've changed what's in the directory rel in B, so its metadata
+// will need fixing (see fixDirectories).
+void DirectoryComparer::touch (RelPath const& rel) {
+   if (!preserve_mode || safe_mode) return;
+   lock_guard<mutex> lock(_touchedMutex);
+   _touched.insert(rel.string());
 }
 
-
-//==============================================================================
-// DirectoryComparer
-//==============================================================================
-
 //------------------------------------------------------------------------------
-void DirectoryComparer::outline () {
-   recursiveCompare();
-   annotate0();
-   annotate1();
-   annotateMutual();
-   printOutline();
+// Gives each directory we changed in B the metadata of its counterpart in A.
+// This waits until everything else is done, since adding or removing a name
+// changes a directory's mtime.
+void DirectoryComparer::fixDirectories () {
+   for (string const& rel : _touched) {
+      path a = groundPath(path(rel), 0);
+      path b = groundPath(path(rel), 1);
+      int fa = ::open(a.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      int fb = ::open(b.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      struct stat st;
+      char const* call = fa < 0 || fb < 0 ? "open" : fstat(fa, &st) != 0 ? "fstat" : copyMetadata(st, fa, fb, xattr_mode);
+      int err = errno;
+      if (fa >= 0) ::close(fa);
+      if (fb >= 0) ::close(fb);
+
+      // a directory that's gone from either side has nothing to fix
+      if (call && err != ENOENT) {
+         throw filesystem_error(call, b, boost::system::error_code(err, boost::system::system_category()));
+      }
+   }
+   _touched.clear();
 }
 
 //------------------------------------------------------------------------------
-void DirectoryComparer::status (bool p0, bool p1, bool ps, bool pi) {
-   recursiveCompare();
-   if (p0) {
-      annotate0();
-      print0();
+// Queues t, or if it's big enough to be worth it (and there are several workers
+// to share it), creates the destination at full size and queues it in chunks.
+// Returns false if t is exclusive and its destination turned out to exist.
+bool DirectoryComparer::queueCopy (CopyQueue& queue, CopyTask const& t) const {
+   if (jobs < 2 || safe_mode || !t.size.bytes || t.size.bytes < split_bytes) {
+      queue.push(t);
+      return true;
    }
-   if (p1) {
-      annotate1();
-      print1();
+
+   // allocate the whole file up front, so the chunks don't fragment it (unless
+   // the source is sparse, in which case the copy should be too); it's made
+   // under a temporary name, and renamed into place by the last chunk (see
+   // publish), since until then it's full size but not all there
+   path target = tempPath(t.dst);
+   if (t.exclusive && existsIn(t.dir[1], t.dst)) return false;
+   int fd = openIn(t.dir[1], target, O_WRONLY | O_CREAT | O_TRUNC);
+   if (fd < 0) {
+      if (errno == EEXIST && t.exclusive) return false;
+      throw filesystem_error("open", target, boost::system::error_code(errno, boost::system::system_category()));
    }
-   if (ps) {
-      annotateMutual();
-      printShared();
+   // the size now, not as scanned, so a file that has grown since is copied whole
+   off_t size = t.size.bytes;
+   struct stat st;
+   bool sparse = false;
+   if (::stat(t.src.c_str(), &st) == 0) {
+      size = st.st_size;
+      sparse = off_t(st.st_blocks) * 512 < st.st_size;
    }
-   if (pi) {
-      printIssues();
+#ifdef __linux__
+   if (sparse || fallocate(fd, 0, 0, size) != 0)
+#endif
+   if (ftruncate(fd, size) != 0) {
+      int err = errno;
+      ::close(fd);
+      ::unlink(target.c_str());
+      throw filesystem_error("ftruncate", target, boost::system::error_code(err, boost::system::system_category()));
    }
-}
+   ::close(fd);
 
-//------------------------------------------------------------------------------
-void DirectoryComparer::backup (bool c, bool d) {
-   recursiveCompare();
-   if (c) copy();
-   if (d) del();
+   // chunks of split_bytes / jobs, but no smaller than 64 MiB
+   off_t chunk = max<off_t>(split_bytes / jobs, 1 << 26);
+   CopyTask c = t;
+   c.temp = target;
+   c.chunks = make_shared<ChunkedFile>((size + chunk - 1) / chunk, target);
+   for (off_t off = 0; off < size; off += chunk) {
+      c.begin = off;
+      c.end = min(off + chunk, size);
+      queue.push(c);
+   }
+   return true;
 }
 
 //------------------------------------------------------------------------------
-void DirectoryComparer::compare () {
-   // clear annotations and temp vecs
-   _annotations = 0;
-   _temp1.clear();
-   _temp2.clear();
-
-   // fill temp vecs
-   directory_iterator end;
-   directory_iterator itr;
-   for (itr = directory_iterator(workingPath(0)); itr != end; ++itr) {
-      if ( ( is_regular_file(itr->path()) || is_directory(itr->path()) ) &&
-           ( ignore_hidden_files && (itr->path().filename().native()[0] != '.') ) ) {
-         _temp1.push_back(itr->path().filename());
-      }
+// Finds the files about to be copied that could be links to another's copy
+// instead: in links mode, other names for the same file in A, and in dedup
+// mode, files with the same contents (going by size, then hash, then comparing
+// them byte for byte, since a hash that matches could still be a collision).
+// Each is mapped to the first of its kind, in the order they're queued.
+void DirectoryComparer::findDuplicates (unordered_map<Entry const*, Entry const*>& sameAs) {
+   vector<Entry const*> files;
+   for (Entry const& e : _uc[0].f) {
+      files.push_back(&e);
    }
-   for (itr = directory_iterator(workingPath(1)); itr != end; ++itr) {
-      if ( ( is_regular_file(itr->path()) || is_directory(itr->path()) ) &&
-           ( ignore_hidden_files && (itr->path().filename().native()[0] != '.') ) ) {
-         _temp2.push_back(itr->path().filename());
-      }
+   for (Entry const& e : _uc[0].d.manifest()) {
+      if (e.isFile()) files.push_back(&e);
    }
 
-   // sort temp vecs
-   sort(_temp1.begin(), _temp1.end());
-   sort(_temp2.begin(), _temp2.end());
-
-   // compare temp vecs
-   vector<path>::iterator itr1 = _temp1.begin();
-   vector<path>::iterator end1 = _temp1.end();
-   vector<path>::iterator itr2 = _temp2.begin();
-   vector<path>::iterator end2 = _temp2.end();
-   path full0;
-   path full1;
-   path rel;
-   auto ground0 = [this] (path const& p) -> path { return groundPath(p, 0); };
-   auto ground1 = [this] (path const& p) -> path { return groundPath(p, 1); };
-   if (itr1 != end1 && itr2 != end2) {
-      full0 = fullPath(*itr1, 0);
-      full1 = fullPath(*itr2, 1);
-      while (true) {
-         //cout << "full0: " << full0 << '\n';
-         //cout << "full1: " << full1 << '\n';
-         // if the names are the same
-         if (*itr1 == *itr2) {
-            // relative path is the same for both directories
-            rel = relPath(*itr1);
-
-            // *itr1 is a file
-            if (is_regular_file(full0)) {
-               // *itr1 is file, *itr2 is file
-               if (is_regular_file(full1)) {
-                  // test that filesizes match
-                  if (file_size(ground0(rel)) == file_size(ground1(rel))) {
-                     // Note that file content may still differ!
-                     // If this is an issue we can check modification dates or
-                     // store hashes (though file metadata is not currently duplicated).
-                     _sc.f.push_back(rel, ground0);
-                  } else {
-                     _sizeIssues.push_back(rel);
-                  }
-               // *itr1 is file, *itr2 is not
-               } else {
-                  _fdIssues.push_back(rel);
-               }
-            // *itr1 is a dir
-            } else {
-               // *itr1 is dir, *itr2 is dir
-               if (is_directory(full1)) {
-                  // Note that directory contents may still differ;
-                  // we will address this later.
-                  _sc.d.push_back(rel);
-               // *itr1 is dir, *itr2 is not
-               } else {
-                  _fdIssues.push_back(rel);
-               }
-            }
-            // advance
-            ++itr1;
-            ++itr2;
-            if (itr1 == end1 || itr2 == end2) { break; }
-            full0 = fullPath(*itr1, 0);
-            full1 = fullPath(*itr2, 1);
-
-         // if *itr1 comes first, it is unique to dir1
-         } else if (*itr1 < *itr2) {
-            _uc[0].add(relPath(*itr1), full0);
-            if (++itr1 == end1) { break; }
-            full0 = fullPath(*itr1, 0);
-
-         // if *itr2 comes first, it is unique to dir2
-         } else {
-            _uc[1].add(relPath(*itr2), full1);
-            if (++itr2 == end2) { break; }
-            full1 = fullPath(*itr2, 1);
-         }
+   if (links_mode) {
+      map<pair<dev_t, ino_t>, Entry const*> first;
+      for (Entry const* e : files) {
+         if (e->nlink < 2) continue;
+         auto r = first.insert(make_pair(make_pair(e->dev, e->ino), e));
+         if (!r.second) sameAs[e] = r.first->second;
       }
    }
+   if (dedup == Dedup::None) return;
 
-   // all remaining contents are unique
-   // (only one of these while loop blocks ever executes)
-   while (itr1 != end1) {
-      _uc[0].add(relPath(*itr1), ground0);
-      ++itr1;
+   // only sizes that turn up more than once are worth hashing
+   unordered_map<FileSize::sizeType, unsigned> sizes;
+   for (Entry const* e : files) {
+      if (e->size.bytes && !sameAs.count(e)) ++sizes[e->size.bytes];
    }
-   while (itr2 != end2) {
-      _uc[1].add(relPath(*itr2), ground1);
-      ++itr2;
+   vector<Entry const*> toHash;
+   for (Entry const* e : files) {
+      if (e->size.bytes && !sameAs.count(e) && sizes[e->size.bytes] > 1) toHash.push_back(e);
    }
-}
+   if (toHash.empty()) return;
 
-//------------------------------------------------------------------------------
-void DirectoryComparer::recursiveCompare () {
-   if (!(_annotations & RC)) {
-      compare();
-      while (_sc.d.size()) {
-         _extension = _sc.d.back();
-         _sc.d.pop_back();
-         compare();
+   cout << "Hashing " << toHash.size() << " files that might be duplicates.\n";
+   vector<uint64_t> hashes(toHash.size());
+   atomic<size_t> next(0);
+   runWorkers(jobs, [&] (unsigned) {
+      vector<char> buf;
+      for (size_t i = next++; i < toHash.size(); i = next++) {
+         hashes[i] = hashFile(groundPath(toHash[i]->path, 0), buf);
       }
-      _extension = "";
-      _annotations |= RC;
+   }, [&] () { next = toHash.size(); });
+
+   map<pair<FileSize::sizeType, uint64_t>, Entry const*> first;
+   vector<pair<Entry const*, Entry const*>> matches;
+   for (size_t i=0; i<toHash.size(); ++i) {
+      auto r = first.insert(make_pair(make_pair(toHash[i]->size.bytes, hashes[i]), toHash[i]));
+      if (!r.second) matches.emplace_back(toHash[i], r.first->second);
+   }
+
+   // a file that only collides with the first is copied as usual
+   vector<char> same(matches.size());
+   next = 0;
+   runWorkers(jobs, [&] (unsigned) {
+      vector<char> buf;
+      for (size_t i = next++; i < matches.size(); i = next++) {
+         same[i] = sameContents(groundPath(matches[i].first->path, 0), groundPath(matches[i].second->path, 0), buf);
+      }
+   }, [&] () { next = matches.size(); });
+   for (size_t i=0; i<matches.size(); ++i) {
+      if (same[i]) sameAs[matches[i].first] = matches[i].second;
    }
 }
 
 //------------------------------------------------------------------------------
+// Directories are all created (and files queued) on this thread first, so they
+// always exist before any worker copies files into them.
 void DirectoryComparer::copy () {
+   PhaseTimer timer(Phase::Copy);
    // variables
-   FileCopier copier(safe_mode);
+   CopyStatus status;
+   CopyQueue queue;
+   SyncBatch batch;
    FileVector& f0 = _uc[0].f;    // for convenience
-   vector<path>& d0 = _uc[0].d;  // for convenience
-   path fullpath0;               // convenience (updated in loops)
-   path fullpath1;               // convenience (updated in loops)
-   FileVector errors;            // holds files that we fail to copy
+   DirVector& d0 = _uc[0].d;     // for convenience
+   vector<path> errors;          // holds files that we fail to copy
    
    // precompute total number of files and bytes to be transferred
    annotate0();
@@ -306,67 +1674,142 @@ void DirectoryComparer::copy () {
    // prepare batch, print totals
    unsigned totalFiles = _uc[0].files();
    FileSize totalBytes = _uc[0].bytes();
-   copier.startBatch(totalFiles, totalBytes);
+   status.startBatch(totalFiles, totalBytes);
    cout << "========== Copying Files from A to B ==========\n";
    cout << "Copying " << totalFiles  << " files totaling " << totalBytes
         << " from " << workingPath(0) << " to " << workingPath(1) << ".\n";
+
+   // files that already exist in B are left alone (copies are exclusive), and
+   // found out about by whoever tries to create them
+   auto existing = [&] (path const& rel) {
+      lock_guard<mutex> lock(status.out);
+      errors.push_back(rel);
+      cout << status << "Warning: Cannot copy " << groundPath(rel, 0) << " to " << groundPath(rel, 1)
+           << " because the latter already exists.\n";
+   };
+   batch.existing = existing;
+
+   // files that can be links to an earlier one's copy wait until it's made
+   unordered_map<Entry const*, Entry const*> sameAs;
+   if ((links_mode || dedup != Dedup::None) && !safe_mode) findDuplicates(sameAs);
+   vector<pair<Entry const*, Entry const*>> aliases;
    cout << "  Bytes Processed   |   Current File\n";
 
-   // copy files from _uc[0].f
-   for (unsigned i=0; i<f0.size(); ++i) {
-      fullpath0 = groundPath(f0[i], 0);
-      fullpath1 = groundPath(f0[i], 1);
-      if (exists(fullpath1)) {
-         // error!
-         errors.push_back(f0[i], fullpath0);
-         cout << "Warning: Cannot copy " << fullpath0 << " to " << fullpath1 << " because the latter already exists.\n";
-      } else {
-         copier.copy(fullpath0, fullpath1, f0[i]);
+   // files are opened by name in their directories, which the copiers open as
+   // needed; consecutive files usually share a directory, and so the OpenDirs
+   OpenDirPtr dirs[2];
+   RelPath dirsFor;
+   auto queueFile = [&] (Entry const& e) {
+      RelPath parent = e.path.parent_path();
+      if (!dirs[0] || parent != dirsFor) {
+         dirs[0] = make_shared<OpenDir>(groundPath(parent, 0));
+         dirs[1] = make_shared<OpenDir>(groundPath(parent, 1));
+         dirsFor = parent;
+         touch(parent);
+      }
+      auto same = sameAs.find(&e);
+      if (same != sameAs.end()) {
+         aliases.emplace_back(&e, same->second);
+         return;
+      }
+      CopyTask t{groundPath(e.path, 0), groundPath(e.path, 1), e.path, e.size};
+      t.dir[0] = dirs[0];
+      t.dir[1] = dirs[1];
+      t.exclusive = true;
+      if (!queueCopy(queue, t)) existing(e.path);
+   };
+
+   // and directories are made by name in their parents
+   OpenDirPtr made;
+   RelPath madeIn;
+   auto makeDir = [&] (Entry const& e) {
+      cout << status << "Creating directory " << e.path << '.' << '\n';
+      if (safe_mode) return;
+      RelPath parent = e.path.parent_path();
+      if (!made || parent != madeIn) {
+         made = make_shared<OpenDir>(groundPath(parent, 1));
+         madeIn = parent;
+      }
+      int fd = made->fd();
+      metrics.count(Call::Mkdir);
+      if ((fd < 0 || mkdirat(fd, e.path.filename().c_str(), 0777) != 0) && errno != EEXIST) {
+         throw filesystem_error("mkdir", groundPath(e.path, 1), boost::system::error_code(errno, boost::system::system_category()));
       }
+      if (durability != Durability::None) batch.addDir(groundPath(parent, 1));
+      touch(parent);
+      touch(e.path);
+   };
+
+   // queue files from _uc[0].f
+   for (Entry const& e : f0) {
+      queueFile(e);
    }
 
-   // copy files from _uc[0].d
-   recursive_directory_iterator end;
-   unsigned depth = 0;
-   path connector;
-   path new_extension;
+   // create directories and queue files from _uc[0].d, using the manifest
+   // built when annotating (where directories precede their contents)
+   vector<Entry> const& manifest = d0.manifest();
    for (unsigned i=0; i<d0.size(); ++i) {
-      // initialize for recursive crawl of this directory
-      recursive_directory_iterator itr(groundPath(d0[i], 0));
-      depth = 0;
-      connector = d0[i];
-      cout << copier.status << "Creating directory " << connector << '.' << '\n';
-      if (!safe_mode) create_directory(_p[1] / connector);
-
-      while (itr != end) {
-         // update connector
-         if (depth < itr.level()) {
-            connector /= new_extension;
-            cout << copier.status << "Creating directory " << connector << '.' << '\n';
-            if (!safe_mode) create_directory(_p[1] / connector);
-            ++depth;  // this makes depth equal to itr.level()
-         } else while (depth > itr.level()) {
-            connector.remove_filename();
-            --depth;
+      makeDir(d0[i]);
+      for (size_t j=d0.manifestBegin(i); j<d0.manifestEnd(i); ++j) {
+         Entry const& e = manifest[j];
+         if (e.isDir()) {
+            makeDir(e);
+         } else if (e.isFile()) {
+            queueFile(e);
          }
+      }
+   }
+   made.reset();
+   dirs[0].reset();
+   dirs[1].reset();
 
-         // copy file or save name of directory we may iterate into
-         if (is_regular_file(itr->path())) {
-            fullpath0 = itr->path();
-            fullpath1 = _p[1] / connector / fullpath0.filename();
-            if (exists(fullpath1)) {
-               // error!
-               errors.push_back(connector / fullpath0.filename(), fullpath0);
-               cout << copier.status << "Warning: Cannot copy " << fullpath0 << " to " << fullpath1 << " because the latter already exists.\n";
-            } else {
-               copier.copy(fullpath0, fullpath1, connector / fullpath0.filename());
-            }
-         } else if (is_directory(itr->path())) {
-            new_extension = itr->path().filename();
+   // copy queued files with a pool of copiers
+   Progress progress(status, progress_ms);
+   Tuner tuner(status, jobs, adaptive_ms, _p[0]);
+   queue.start(jobs);
+   runWorkers(jobs, [&] (unsigned) {
+      FileCopier copier(status, safe_mode);
+      prepare(copier, batch);
+      CopyTask t;
+      bool large;
+      while (queue.pop(t, large)) {
+         AdaptiveLimit::Slot slot(tuner.limit());
+         if (!(t.chunks ? copier.copyChunk(t) : copier.copy(t))) {
+            existing(t.dsp);
+         }
+         t = CopyTask();  // let go of its directories
+         queue.done(large);
+      }
+   }, [&] () { queue.cancel(); });
+   tuner.stop();
+   batch.flush();
+
+   // then the links, to copies made above (or earlier in this loop); if the
+   // original couldn't be copied, its duplicate is copied after all
+   if (aliases.size()) {
+      FileCopier copier(status, safe_mode);
+      prepare(copier, batch);
+      set<string> failed;
+      for (path const& p : errors) {
+         failed.insert(p.string());
+      }
+      for (auto const& a : aliases) {
+         Entry const& e = *a.first;
+         Entry const& o = *a.second;
+         CopyTask t{groundPath(e.path, 0), groundPath(e.path, 1), e.path, e.size};
+         CopyTask original{groundPath(o.path, 0), groundPath(o.path, 1), o.path, o.size};
+         t.exclusive = true;
+         bool clone = dedup == Dedup::Clone && !(links_mode && e.dev == o.dev && e.ino == o.ino);
+         bool copied = failed.count(o.path.string()) ? copier.copy(t) : copier.copyFrom(t, original, clone);
+         if (!copied) {
+            failed.insert(e.path.string());
+            existing(e.path);
          }
-         ++itr;
       }
+      batch.flush();
    }
+   progress.stop();
+   metrics.moved(status.bytes, status.files);
 
    // cleanup
    _uc[0].f.clear();
@@ -376,6 +1819,16 @@ void DirectoryComparer::copy () {
    // print outline
    cout << setw(9) << totalBytes << '/' << setw(9) << totalBytes << " | ";
    cout << totalFiles - errors.size() << " of " << totalFiles << " files were copied.\n";
+   if (clone_mode) {
+      cout << "Cloned " << FileSize(status.clonedBytes.load()) << " and copied " << FileSize(status.copiedBytes.load()) << ".\n";
+   }
+   if (status.holeBytes) {
+      cout << "Of " << totalBytes << " (logical), " << FileSize(status.holeBytes.load())
+           << " were holes in sparse files, so only " << FileSize(totalBytes.bytes - status.holeBytes) << " were copied.\n";
+   }
+   if (status.linkedBytes) {
+      cout << FileSize(status.linkedBytes.load()) << " were linked to (or cloned from) other copies instead of being copied.\n";
+   }
    if (errors.size()) {
       cout << "The following files were not copied:\n";
       for (unsigned i=0; i<errors.size(); ++i) {
@@ -386,30 +1839,512 @@ void DirectoryComparer::copy () {
 }
 
 //------------------------------------------------------------------------------
+// Rewrites the files in B that were modified in A. Each is copied to tempPath
+// and renamed into place, so an interrupted update leaves the old copy intact.
+// In delta mode large files are sent as deltas, and may be patched in place.
+void DirectoryComparer::update () {
+   PhaseTimer timer(Phase::Update);
+   // variables
+   CopyStatus status;
+   CopyQueue queue;
+   SyncBatch batch;
+   FileVector updated;
+   for (EntryPair const& p : _modified) {
+      updated.push_back(p.first);
+   }
+
+   // prepare batch, print totals
+   unsigned totalFiles = updated.files();
+   FileSize totalBytes = updated.bytes();
+   status.startBatch(totalFiles, totalBytes);
+   cout << "========== Updating Files in B ==========\n";
+   cout << "Updating " << totalFiles  << " files totaling " << totalBytes
+        << " from " << workingPath(0) << " to " << workingPath(1) << ".\n";
+   cout << "  Bytes Processed   |   Current File\n";
+
+   for (Entry const& e : updated) {
+      queue.push(CopyTask{groundPath(e.path, 0), groundPath(e.path, 1), e.path, e.size});
+      touch(e.path.parent_path());
+   }
+
+   // copy queued files with a pool of copiers, renaming each when it's done
+   Progress progress(status, progress_ms);
+   Tuner tuner(status, jobs, adaptive_ms, _p[0]);
+   queue.start(jobs);
+   runWorkers(jobs, [&] (unsigned) {
+      FileCopier copier(status, safe_mode);
+      prepare(copier, batch);
+      CopyTask t;
+      bool large;
+      while (queue.pop(t, large)) {
+         AdaptiveLimit::Slot slot(tuner.limit());
+         replace(copier, t);
+         queue.done(large);
+      }
+   }, [&] () { queue.cancel(); });
+   tuner.stop();
+   batch.flush();
+   progress.stop();
+   metrics.moved(status.bytes, status.files);
+
+   // cleanup
+   _modified.clear();
+
+   // print outline
+   cout << setw(9) << totalBytes << '/' << setw(9) << totalBytes << " | ";
+   cout << totalFiles << " files were updated.\n";
+   if (delta_mode) {
+      cout << "Found " << FileSize(status.matchedBytes.load()) << " already in " << workingPath(1)
+           << " and copied " << FileSize(status.copiedBytes.load()) << ".\n";
+   }
+   cout << '\n';
+}
+
+//------------------------------------------------------------------------------
+// Copies t.src over t.dst by way of tempPath (or as a delta, in delta mode).
+void DirectoryComparer::replace (FileCopier& copier, CopyTask const& t) const {
+   path temp = tempPath(t.dst);
+   try {
+      bool patched = false;
+      if (delta_mode && !safe_mode && t.size.bytes >= copier.delta_bytes) {
+         patched = copier.copyDelta(t.src, t.dst, temp, t.dsp, t.size, inplace_mode);
+      } else {
+         copier.copy(t.src, temp, t.dsp, t.size);
+      }
+      if (!safe_mode && durability != Durability::None) {
+         syncPath(patched ? t.dst : temp, true);
+         copier.batch->addDir(t.dst.parent_path());
+      }
+      if (!safe_mode && !patched) rename(temp, t.dst);
+   } catch (...) {
+      boost::system::error_code ec;
+      if (!safe_mode) remove(temp, ec);
+      throw;
+   }
+}
+
+//------------------------------------------------------------------------------
+// The directory rel under top, to be opened a name at a time (so never through
+// a link) when its fd is asked for.
+static OpenDirPtr openBelow (OpenDirPtr const& top, RelPath const& rel) {
+   if (rel.empty()) return top;
+   return make_shared<OpenDir>(openBelow(top, rel.parent_path()), rel.filename());
+}
+
+//------------------------------------------------------------------------------
+// Empties directories in parallel, each from the bottom up: the files in a
+// directory are unlinked (by name, in batches) by whichever workers get to them,
+// and once every batch and subdirectory of a directory unique to B is gone, the
+// directory itself is removed, which may in turn leave its parent ready to go.
+// Progress counts the sizes found when annotating, so nothing is stat'ed again.
+// Directories are opened from the top of B down, never following a link, and a
+// link is removed rather than anything it points to.
 void DirectoryComparer::del () {
-   // precompute total number of files and bytes to be transferred
+   PhaseTimer timer(Phase::Delete);
+   // precompute total number of files and bytes to be removed
    annotate1();
 
    // prepare batch, print totals
+   CopyStatus status;
    unsigned totalFiles = _uc[1].files();
    FileSize totalBytes = _uc[1].bytes();
+   status.startBatch(totalFiles, totalBytes);
    cout << "========== Deleting Files from B ==========\n";
    cout << "Removing " << totalFiles  << " files totaling " << totalBytes
         << " from " << workingPath(1) << ".\n";
 
-   // delete files in _uc[1].f
-   path grounded;
-   for (path const& p : _uc[1].f) {
-      grounded = groundPath(p, 1);
-      cout << "Removing " << p << " (" << FileSize(file_size(grounded)) << ").\n";
-      if (!safe_mode) remove(grounded);
+   DirVector const& d1 = _uc[1].d;
+   vector<Entry> const& manifest = d1.manifest();
+   if (safe_mode) {
+      for (Entry const& e : _uc[1].f) {
+         cout << "Removing " << e.path << " (" << e.size << ").\n";
+      }
+      for (unsigned i=0; i<d1.size(); ++i) {
+         cout << "Removing " << d1[i].path << ".\n";
+      }
+      cout << '\n';
+      return;
+   }
+   cout << "  Bytes Reclaimed   |   Removed\n";
+
+   // the directories to empty: those holding files in _uc[1].f, which stay, and
+   // those in _uc[1].d and everything under them, which go too
+   struct Dir {
+      RelPath path;
+      int parent;    // the directory this one is in, if it's to go as well
+      bool remove;
+      vector<Entry const*> files;
+   };
+   vector<Dir> dirs;
+   unordered_map<PathNode const*, unsigned> index;
+   for (Entry const& e : _uc[1].f) {
+      RelPath parent = e.path.parent_path();
+      auto itr = index.find(parent.node());
+      if (itr == index.end()) {
+         itr = index.insert(make_pair(parent.node(), unsigned(dirs.size()))).first;
+         dirs.push_back(Dir{parent, -1, false, vector<Entry const*>()});
+      }
+      dirs[itr->second].files.push_back(&e);
+   }
+   for (unsigned i=0; i<d1.size(); ++i) {
+      index[d1[i].path.node()] = dirs.size();
+      dirs.push_back(Dir{d1[i].path, -1, true, vector<Entry const*>()});
+      for (size_t j=d1.manifestBegin(i); j<d1.manifestEnd(i); ++j) {
+         Entry const& e = manifest[j];
+         unsigned parent = index[e.path.parent_path().node()];
+         if (e.isDir()) {
+            index[e.path.node()] = dirs.size();
+            dirs.push_back(Dir{e.path, int(parent), true, vector<Entry const*>()});
+         } else {
+            dirs[parent].files.push_back(&e);
+         }
+      }
+   }
+
+   // a directory can go once its batches of files and subdirectories have
+   struct Task {
+      unsigned dir;
+      size_t begin;   // a batch of its files, or if empty the directory itself
+      size_t end;
+   };
+   static const size_t batchFiles = 1024;
+   unique_ptr<atomic<size_t>[]> pending(new atomic<size_t>[dirs.size()]);
+   for (size_t d=0; d<dirs.size(); ++d) {
+      pending[d] = (dirs[d].files.size() + batchFiles - 1) / batchFiles;
+   }
+   for (Dir const& d : dirs) {
+      if (d.parent >= 0) ++pending[d.parent];
+   }
+   WorkStealingQueues<Task> queue(jobs);
+   unsigned next = 0;
+   for (unsigned d=0; d<dirs.size(); ++d) {
+      for (size_t b=0; b<dirs[d].files.size(); b+=batchFiles) {
+         queue.push(next++ % jobs, Task{d, b, min(b + batchFiles, dirs[d].files.size())});
+      }
+      if (!pending[d] && dirs[d].remove) queue.push(next++ % jobs, Task{d, 0, 0});
+   }
+
+   auto print = [&] (RelPath const& rel, FileSize const* size) {
+      lock_guard<mutex> lock(status.out);
+      cout << status << "Removed " << rel;
+      if (size) cout << " (" << *size << ')';
+      cout << ".\n";
+   };
+   OpenDirPtr top = make_shared<OpenDir>(_p[1]);
+   Progress progress(status, progress_ms, true);
+   runWorkers(jobs, [&] (unsigned id) {
+      Task t;
+      while (queue.pop(id, t)) {
+         Dir const& d = dirs[t.dir];
+         if (t.end > t.begin) {
+            OpenDirPtr open = openBelow(top, d.path);
+            int fd = open->fd();
+            for (size_t i=t.begin; i<t.end; ++i) {
+               Entry const& e = *d.files[i];
+               TraceSpan span("unlink", tracer.on() ? e.path.string().c_str() : "");
+               metrics.count(Call::Unlink);
+               if ((fd < 0 || unlinkat(fd, e.path.filename().c_str(), 0) != 0) && errno != ENOENT) {
+                  throw filesystem_error("unlink", groundPath(e.path, 1), boost::system::error_code(errno, boost::system::system_category()));
+               }
+               if (!e.isFile()) continue;
+               status.bytes += e.size.bytes;
+               ++status.files;
+               if (!d.remove) print(e.path, &e.size);
+            }
+            if (!d.remove) touch(d.path);
+         } else {
+            // anything that appeared since annotation isn't in the manifest, so
+            // a directory that won't go quietly is given to remove_all (which
+            // doesn't follow links either), and one that's become a link since
+            // is unlinked
+            path full = groundPath(d.path, 1);
+            TraceSpan span("rmdir", full.c_str());
+            metrics.count(Call::Unlink);
+            OpenDirPtr in = openBelow(top, d.path.parent_path());
+            int fd = in->fd();
+            path name = full.filename();
+            if (fd < 0 || unlinkat(fd, name.c_str(), AT_REMOVEDIR) != 0) {
+               int err = errno;
+               if (err == ENOTDIR && fd >= 0 && unlinkat(fd, name.c_str(), 0) == 0) err = 0;
+               if (err == ENOTEMPTY || err == EEXIST) {
+                  remove_all(full);
+               } else if (err && err != ENOENT) {
+                  throw filesystem_error("rmdir", full, boost::system::error_code(err, boost::system::system_category()));
+               }
+            }
+            if (d.parent < 0) {
+               touch(d.path.parent_path());
+               print(d.path, 0);
+            }
+         }
+
+         // which may leave its directory ready to go
+         int parent = t.end > t.begin ? int(t.dir) : d.parent;
+         if (parent >= 0 && --pending[parent] == 0 && dirs[parent].remove) {
+            queue.push(id, Task{unsigned(parent), 0, 0});
+         }
+         queue.done();
+      }
+   }, [&] () { queue.cancel(); });
+   progress.stop();
+   metrics.moved(status.bytes, status.files);
+
+   // print outline
+   cout << setw(9) << FileSize(status.bytes.load()) << '/' << setw(9) << totalBytes << " | ";
+   cout << status.files << " of " << totalFiles << " files were removed.\n\n";
+}
+
+//------------------------------------------------------------------------------
+// Compares A and B and backs them up at the same time. The first jobs workers
+// compare directories and act on what they find (creating directories, queueing
+// copies and updates, removing things), and the other jobs workers copy. Each
+// comparing worker's Comparison is emptied after every directory.
+void DirectoryComparer::stream (bool c, bool d) {
+   PhaseTimer timer(Phase::Stream);
+   // variables
+   CopyStatus status;
+   CopyQueue queue;
+   SyncBatch batch;
+   vector<path> errors;          // holds files that we fail to copy
+   unsigned copies = 0;          // these are all changed while holding status.out
+   unsigned updates = 0;
+   unsigned removedFiles = 0;
+   unsigned removedDirs = 0;
+   FileSize removedBytes(0);
+   unsigned shared = 0;
+   FileSize sharedBytes(0);
+   unsigned conflicts = 0;
+
+   // print what we're doing; totals come as they're found
+   status.startBatch(0, 0);
+   status.scanning = true;
+   cout << "========== Backing up A to B ==========\n";
+   cout << (c && d ? "Copying and deleting" : c ? "Copying" : "Deleting") << " while comparing "
+        << workingPath(0) << " and " << workingPath(1) << ".\n";
+   cout << "  Bytes Processed   |   Current File\n";
+
+   vector<Comparison> found(jobs);
+   WorkStealingQueues<DirTask> dirs(jobs);
+   dirs.push(0, DirTask{ RelPath(), { make_shared<OpenDir>(_p[0]), make_shared<OpenDir>(_p[1]) } });
+   openCatalog();
+   queue.capacity = stream_tasks;
+   queue.start(jobs, true);
+
+   auto existing = [&] (path const& rel) {
+      lock_guard<mutex> lock(status.out);
+      errors.push_back(rel);
+      cout << status << "Warning: Cannot copy " << groundPath(rel, 0) << " to " << groundPath(rel, 1)
+           << " because the latter already exists.\n";
+   };
+   batch.existing = existing;
+
+   // queues e, which is in t's directory, to be copied (or updated). The copy
+   // doesn't hold on to t's OpenDirs, which are open, since a full queue of them
+   // could pin thousands of fds; instead the files queued from a directory share
+   // a pair of its own, made in byPath, which aren't opened (by path) until a
+   // copier gets to them, and close once its last file is copied.
+   auto queueFile = [&] (DirTask const& t, OpenDirPtr (&byPath)[2], Entry const& e, bool update) {
+      if (!byPath[0]) {
+         byPath[0] = make_shared<OpenDir>(groundPath(t.ext, 0));
+         byPath[1] = make_shared<OpenDir>(groundPath(t.ext, 1));
+      }
+      CopyTask task{groundPath(e.path, 0), groundPath(e.path, 1), e.path, e.size};
+      task.dir[0] = byPath[0];
+      task.dir[1] = byPath[1];
+      task.exclusive = !update;
+      task.update = update;
+      touch(t.ext);
+      {
+         lock_guard<mutex> lock(status.out);
+         ++(update ? updates : copies);
+         ++status.totalFiles;
+         status.totalBytes += e.size;
+      }
+      if (update) {
+         queue.push(task);
+      } else if (!queueCopy(queue, task)) {
+         existing(e.path);
+      }
+   };
+
+   // makes e, a directory unique to A, in t's directory in B
+   auto makeDir = [&] (DirTask const& t, Entry const& e) {
+      {
+         lock_guard<mutex> lock(status.out);
+         cout << status << "Creating directory " << e.path << '.' << '\n';
+      }
+      if (safe_mode) return;
+      int fd = t.dir[1]->fd();
+      metrics.count(Call::Mkdir);
+      if ((fd < 0 || mkdirat(fd, e.path.filename().c_str(), 0777) != 0) && errno != EEXIST) {
+         throw filesystem_error("mkdir", groundPath(e.path, 1), boost::system::error_code(errno, boost::system::system_category()));
+      }
+      if (durability != Durability::None) batch.addDir(groundPath(t.ext, 1));
+      touch(t.ext);
+      touch(e.path);
+   };
+
+   // removes e, which is unique to B, from t's directory in B
+   auto removeUnique = [&] (DirTask const& t, Entry const& e) {
+      touch(t.ext);
+      {
+         lock_guard<mutex> lock(status.out);
+         if (e.isDir()) {
+            cout << status << "Removing " << e.path << ".\n";
+            ++removedDirs;
+         } else {
+            cout << status << "Removing " << e.path << " (" << e.size << ").\n";
+            ++removedFiles;
+            removedBytes += e.size;
+         }
+      }
+      if (safe_mode) return;
+      TraceSpan span(e.isDir() ? "rmdir" : "unlink", tracer.on() ? e.path.string().c_str() : "");
+      int fd = t.dir[1]->fd();
+      metrics.count(Call::Unlink);
+      if (fd >= 0 && unlinkat(fd, e.path.filename().c_str(), e.isDir() ? AT_REMOVEDIR : 0) == 0) return;
+      if (e.isDir()) {
+         remove_all(groundPath(e.path, 1));
+      } else if (errno != ENOENT) {
+         throw filesystem_error("unlink", groundPath(e.path, 1), boost::system::error_code(errno, boost::system::system_category()));
+      }
+   };
+
+   // queues e, a directory in t's, to be compared (or if unique, walked)
+   auto descend = [&] (unsigned id, DirTask const& t, Entry const& e, bool unique) {
+      PathNode const* n = e.path.node();
+      path name = e.path.filename();
+      shared_ptr<PathNode const> node = PathNode::make(t.name, n->name(), n->length);
+      dirs.push(id, DirTask{ RelPath(node.get()), { make_shared<OpenDir>(t.dir[0], name),
+                                                    make_shared<OpenDir>(t.dir[1], name) }, unique, node });
+   };
+
+   // compare and copy, with a pool of each
+   Progress progress(status, progress_ms);
+   Tuner tuner(status, jobs, adaptive_ms, _p[0]);
+   atomic<unsigned> comparing(jobs);
+   runWorkers(2 * jobs, [&] (unsigned id) {
+      if (id >= jobs) {
+         FileCopier copier(status, safe_mode);
+         prepare(copier, batch);
+         CopyTask t;
+         bool large;
+         while (queue.pop(t, large)) {
+            AdaptiveLimit::Slot slot(tuner.limit());
+            if (t.update) {
+               replace(copier, t);
+            } else if (!(t.chunks ? copier.copyChunk(t) : copier.copy(t))) {
+               existing(t.dsp);
+            }
+            t = CopyTask();  // let go of its directories
+            queue.done(large);
+         }
+         return;
+      }
+
+      Comparison& cmp = found[id];
+      DirTask t;
+      while (dirs.pop(id, t)) {
+         OpenDirPtr byPath[2];
+         if (t.unique) {
+            // everything in a directory unique to A is copied
+            cmp.temp1.clear();
+            scanDirectory(*t.dir[0], groundPath(t.ext, 0), t.ext, ignore_hidden_files, cmp.names, cmp.temp1);
+            for (Entry const& e : cmp.temp1) {
+               if (e.isDir()) {
+                  makeDir(t, e);
+                  descend(id, t, e, true);
+               } else if (e.isFile()) {
+                  queueFile(t, byPath, e, false);
+               }
+            }
+         } else if (!skipCatalogued(t, cmp)) {
+            compare(t, cmp);
+            if (c) {
+               for (Entry const& e : cmp.uc[0].f) queueFile(t, byPath, e, false);
+               for (EntryPair const& p : cmp.modified) queueFile(t, byPath, p.first, true);
+               for (Entry const& e : cmp.uc[0].d) {
+                  makeDir(t, e);
+                  descend(id, t, e, true);
+               }
+            }
+            if (d) {
+               for (Entry const& e : cmp.uc[1].f) removeUnique(t, e);
+               for (Entry const& e : cmp.uc[1].d) removeUnique(t, e);
+            }
+            for (Entry const& e : cmp.sc.d) {
+               descend(id, t, e, false);
+            }
+
+            lock_guard<mutex> lock(status.out);
+            shared += cmp.sc.f.size();
+            sharedBytes += cmp.sc.f.bytes();
+            conflicts += cmp.sizeIssues.size() + cmp.fdIssues.size();
+            for (EntryPair const& p : cmp.sizeIssues) {
+               cout << status << "Warning: " << p.first.path << " is " << p.first.size << " in " << _p[0]
+                    << " but " << p.second.size << " in " << _p[1] << ", so it won't be copied.\n";
+            }
+            for (EntryPair const& p : cmp.fdIssues) {
+               cout << status << "Warning: " << p.first.path << " is a " << p.first.kind()
+                    << " in " << _p[0] << " but a " << p.second.kind() << " in " << _p[1]
+                    << ", so it won't be copied.\n";
+            }
+         }
+         cmp.clearFound();
+         cmp.names.clear();
+         t = DirTask();  // so this directory is closed once its subdirectories are open
+         dirs.done();
+      }
+
+      // the last comparer out lets the copiers finish
+      if (--comparing == 0) {
+         lock_guard<mutex> lock(status.out);
+         status.scanning = false;
+         queue.close();
+      }
+   }, [&] () {
+      dirs.cancel();
+      queue.cancel();
+   });
+   tuner.stop();
+   batch.flush();
+   progress.stop();
+   metrics.moved(status.bytes, status.files);
+
+   // the catalog only needs the records
+   for (Comparison& cmp : found) {
+      _dirs.insert(_dirs.end(), cmp.dirs.begin(), cmp.dirs.end());
+      _skippedFiles += cmp.skippedFiles;
+      _skippedBytes += cmp.skippedBytes;
    }
+   closeCatalog();
 
-   // delete files in _uc[1].d
-   for (path const& p : _uc[1].d) {
-      cout << "Removing " << p << ".\n";
-      if (!safe_mode) remove_all(groundPath(p, 1));
+   // print outline
+   cout << status;
+   if (c) {
+      cout << copies - errors.size() << " of " << copies << " files were copied";
+      if (update_mode) cout << ", and " << updates << " were updated";
+      cout << ".\n";
+   } else {
+      cout << "Nothing was copied.\n";
+   }
+   if (d) {
+      cout << "Removed " << removedFiles << " files (" << removedBytes << ") and " << removedDirs << " directories.\n";
+   }
+   cout << shared + _skippedFiles << " files (" << sharedBytes + _skippedBytes << ") were already backed up.\n";
+   if (conflicts) {
+      cout << conflicts << " files are in conflict and must be manually resolved.\n";
+   }
+   if (clone_mode) {
+      cout << "Cloned " << FileSize(status.clonedBytes.load()) << " and copied " << FileSize(status.copiedBytes.load()) << ".\n";
+   }
+   if (errors.size()) {
+      cout << "The following files were not copied:\n";
+      for (unsigned i=0; i<errors.size(); ++i) {
+         cout << errors[i] << '\n';
+      }
    }
+   cout << '\n';
 }
 
 //------------------------------------------------------------------------------
@@ -418,6 +2353,20 @@ void DirectoryComparer::print0 () const {
    _uc[0].print();
 }
 
+//------------------------------------------------------------------------------
+void DirectoryComparer::printModified () const {
+   cout << "========== Modified in " << _p[0] << " ==========\n";
+   FileSize bytes(0);
+   for (EntryPair const& p : _modified) {
+      bytes += p.first.size;
+   }
+   cout << _modified.size() << " files totaling " << bytes << '.' << '\n';
+   for (EntryPair const& p : _modified) {
+      cout << "  * " << p.first.path << '\n';
+   }
+   cout << '\n';
+}
+
 //------------------------------------------------------------------------------
 void DirectoryComparer::print1 () const {
    cout << "========== Unique to " << _p[1] << " ==========\n";
@@ -436,18 +2385,17 @@ void DirectoryComparer::printShared () const {
 //------------------------------------------------------------------------------
 void DirectoryComparer::printIssues () const {
    cout << "========== Issues ==========\n";
-   if (_sizeIssues.size() || _fdIssues.size()) {
-      for (path const& p : _sizeIssues) {
-         cout << "  * " << p << " is "  << FileSize(file_size(groundPath(p, 0))) << " in " << _p[0]
-              << " but " << FileSize(file_size(groundPath(p, 1))) << " in " << _p[1] << '.' << '\n';
-      }
-      for (path const& p : _fdIssues) {
-         cout << "  * ";
-         if (is_regular_file(groundPath(p, 0))) {
-            cout << p << " is a file in " << _p[0] << " but a directory in " << _p[1] << '.' << '\n';
-         } else {
-            cout << p << " is a directory in " << _p[0] << " but a file in " << _p[1] << '.' << '\n';
-         }
+   if (_sizeIssues.size() || _fdIssues.size() || _contentIssues.size()) {
+      for (EntryPair const& p : _sizeIssues) {
+         cout << "  * " << p.first.path << " is "  << p.first.size << " in " << _p[0]
+              << " but " << p.second.size << " in " << _p[1] << '.' << '\n';
+      }
+      for (EntryPair const& p : _fdIssues) {
+         cout << "  * " << p.first.path << " is a " << p.first.kind() << " in " << _p[0]
+              << " but a " << p.second.kind() << " in " << _p[1] << '.' << '\n';
+      }
+      for (EntryPair const& p : _contentIssues) {
+         cout << "  * " << p.first.path << " has different contents in " << _p[0] << " and " << _p[1] << '.' << '\n';
       }
    } else {
       cout << "No issues detected. Backup should run smoothly.\n";
@@ -461,9 +2409,20 @@ void DirectoryComparer::printOutline () const {
    cout << "Directory A: " << _p[0] << '\n';
    cout << "Directory B: " << _p[1] << '\n';
    cout << setw(5) << _uc[0].files() << " files (" << setw(9) << _uc[0].bytes() << ") are to be copied.\n";
+   if (update_mode) {
+      FileSize bytes(0);
+      for (EntryPair const& p : _modified) {
+         bytes += p.first.size;
+      }
+      cout << setw(5) << _modified.size() << " files (" << setw(9) << bytes << ") are to be updated.\n";
+   }
    cout << setw(5) << _uc[1].files() << " files (" << setw(9) << _uc[1].bytes() << ") are to be deleted.\n";
-   cout << setw(5) << _sc.files()    << " files (" << setw(9) << _sc.bytes() << ") are already backed up.\n";
-   cout << setw(5) << _sizeIssues.size() + _fdIssues.size() << " files are in conflict and must be manually resolved.\n";
+   cout << setw(5) << _sc.files() + _skippedFiles << " files (" << setw(9) << _sc.bytes() + _skippedBytes
+        << ") are already backed up.\n";
+   if (_skippedFiles) {
+      cout << setw(5) << _skippedFiles << " of these are in directories unchanged since the catalog was written.\n";
+   }
+   cout << setw(5) << _sizeIssues.size() + _fdIssues.size() + _contentIssues.size() << " files are in conflict and must be manually resolved.\n";
    cout << '\n';
 }
 
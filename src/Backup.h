@@ -4,10 +4,24 @@
 //==============================================================================
 
 #include <vector>
+#include <deque>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <set>
+#include <unordered_map>
 #include <fstream>
+#include <memory>
 #include <boost/filesystem.hpp>
 #include "FileSize.h"
+#include "Entry.h"
+#include "Catalog.h"
+#include "Hash.h"
+#include "Delta.h"
+#include "CopyEngine.h"
+#include "Workers.h"
 
 namespace bfs = boost::filesystem;
 
@@ -18,59 +32,274 @@ namespace bfs = boost::filesystem;
 
 //------------------------------------------------------------------------------
 /*
- * Note: FileCopier copies files using an ifstream, an ofstream,
- * and an intermediate buffer. As a result, file metadata is NOT copied.
- * However, fstreams make it very easy to determine progress while copying
- * large files - just count how many buffers you have transferred.
+ * Note: FileCopier hands the actual business of copying to a list of
+ * CopyEngines (see CopyEngine.h). On linux these are copy_file_range, sendfile,
+ * and splice, tried in that order, so bytes move from file to file inside the
+ * kernel. Engines are called in a loop on chunk_bytes sized ranges, so we still
+ * get progress updates for large files. File metadata is NOT copied.
  *
- * Additionally, though fstreams are pretty efficient,
- * faster methods are available if you use platform-dependent methods –
- * the linux system call splice is probably the standout option.
- * Furthermore splice can be used in a loop, thus preserving our progress updates.
+ * In clone mode a CloneEngine is tried first. Whether a file can be cloned is
+ * decided file by file (btrfs refuses nodatacow files, for instance), so a
+ * failed clone only sends that one file on to the byte copying engines.
  *
- * Finally, I have not tested to see what buffer size is ideal (BUFSIZ seems to
- * 1024 bytes, which seems very small). I would rather start using splice than
- * spend time optimizing a slower method.
+ * If no engine is supported (other platforms, odd filesystems, or the user asked
+ * for "stream") we fall back on the original method: an ifstream, an ofstream,
+ * and an intermediate buffer. Safe mode also uses the stream path, since it
+ * needs to read the source without opening a destination.
+ *
+ * With preserve set, each copy is given the source's mode, ownership (as far as
+ * we're allowed), and access and modification times, and with xattrs its
+ * extended attributes (and so its ACLs), all through the open descriptors once
+ * the data is written. A copy's mtime then matches the original's, so a later
+ * comparison can trust size and mtime.
+ *
+ * Large files being updated can instead be sent as a delta (see Delta.h):
+ * copyDelta builds the new file from the blocks of the old one that are still
+ * good plus whatever else changed, or patches the old file in place.
+ *
+ * Sparse files are copied extent by extent (found with SEEK_DATA and SEEK_HOLE),
+ * so holes are neither read nor written and stay holes in the copy. Progress
+ * counts the logical size, holes included; holeBytes says how much of that was
+ * never copied. The stream path still copies every byte.
+ *
+ * Very large files can be split into chunks (see CopyTask) so that several
+ * FileCopiers work on one file at once. The destination is created at full size,
+ * under a temporary name (whatever the durability) so that a half-copied file is
+ * never taken for a finished one, before any chunks are handed out. The last
+ * chunk to finish renames it into place; if any chunk fails instead, the
+ * temporary file is removed once the rest are done with (see ChunkedFile).
+ * Each chunk is copied at its own offset with the same engines
+ * (copy_file_range takes explicit offsets), or with pread and pwrite if none of
+ * them work.
+ *
+ * How durable a new copy is made depends on durability. With None it's left to
+ * the kernel to write back whenever it likes, so after a crash a file can be in
+ * place but incomplete (and an exclusive copy will never overwrite it). File
+ * syncs (fdatasync) each file before closing it. Atomic writes each file to a
+ * hidden temporary (tempPath), syncs it, and renames it into place, so a file
+ * is either complete or absent. Batch is Atomic without a sync per file: each
+ * temporary is handed to a SyncBatch, which after a few hundred files (or
+ * megabytes) syncs the whole filesystem once and renames them all. In every
+ * mode but None the directories whose entries changed are synced at the end of
+ * each batch too, or the new names could be lost.
+ *
+ * The stream path reads through a buffer of buffer_bytes (the same size as the
+ * io_uring engine's buffers), rather than the BUFSIZ I started with; BUFSIZ is
+ * only a few kilobytes, which is very small. The engines make this less
+ * important.
  */
 
 //------------------------------------------------------------------------------
+// Progress through a batch of copies. One CopyStatus is shared by every
+// FileCopier working on the batch (see DirectoryComparer::copy), so the counters
+// are atomic and progress lines are printed while holding out. While scanning,
+// more files are still being found (see DirectoryComparer::stream), so the
+// totals are only what's been found so far; they're changed while holding out.
 struct CopyStatus {
+   typedef std::atomic<FileSize::sizeType> Counter;
    static const unsigned fsw = 9;
 
-   FileSize bytes;
+   Counter bytes;
    FileSize totalBytes;
+   Counter clonedBytes;    // bytes that now share storage with the source
+   Counter copiedBytes;    // bytes that were actually written
+   Counter matchedBytes;   // bytes a delta found already in the old file
+   Counter holeBytes;      // bytes of sparse files' holes, which are skipped rather than copied
+   Counter linkedBytes;    // bytes of files linked to (or cloned from) another copy of them
+   std::atomic<unsigned> files;
+   unsigned totalFiles;
+   std::atomic<bool> scanning;
+   std::mutex out;
+
+   CopyStatus (): bytes(0), totalBytes(0), clonedBytes(0), copiedBytes(0), matchedBytes(0), holeBytes(0), linkedBytes(0), files(0),
+                  totalFiles(0),
+                  scanning(false) {}
+   void startBatch (unsigned nFiles, FileSize nBytes);
+};
+std::ostream& operator<< (std::ostream& os, CopyStatus const& s);
+
+//------------------------------------------------------------------------------
+// How hard to try to make copies survive a crash (see the note above).
+enum class Durability : unsigned char { None, File, Batch, Atomic };
+
+//------------------------------------------------------------------------------
+// What to do with files whose contents match a file copied before them.
+enum class Dedup : unsigned char { None, Link, Clone };
+
+//------------------------------------------------------------------------------
+// Copies waiting in temporary files to be synced and renamed into place, and
+// directories waiting to be synced. Shared by every FileCopier working on a
+// batch. existing is told about exclusive copies whose names were taken in the
+// meantime (whose temporaries are removed).
+class SyncBatch {
+private:
+   struct Pending {
+      bfs::path temp;
+      bfs::path dst;
+      bfs::path dsp;
+      bool exclusive;
+   };
+   std::vector<Pending> _pending;
+   FileSize::sizeType _bytes;
+   std::set<bfs::path> _dirs;
+   std::mutex _m;
+
+public:
+   unsigned max_files;
+   FileSize::sizeType max_bytes;
+   std::function<void (bfs::path const&)> existing;
+
+public:
+   SyncBatch (): _bytes(0), max_files(512), max_bytes(1ul << 28) {}
+   // Queues temp to be renamed to dst, syncing the batch if it's full.
+   void add (bfs::path const& temp, bfs::path const& dst, bfs::path const& dsp, bool exclusive,
+             FileSize::sizeType bytes);
+   void addDir (bfs::path const& dir);
+   void flush ();
+
+private:
+   void sync ();
+};
+
+//------------------------------------------------------------------------------
+// Progress through the file a single FileCopier is working on.
+struct FileStatus {
    FileSize fileBytes;
    FileSize fileTotal;
-   //unsigned files;
-   unsigned totalFiles;
    bfs::path srcPath;
    bfs::path dstPath;
    bfs::path dspPath;
 
-   CopyStatus (): bytes(0), totalBytes(0), fileBytes(0), totalFiles(0) {}
+   FileStatus (): fileBytes(0), fileTotal(0) {}
 };
-std::ostream& operator<< (std::ostream& os, CopyStatus const& s);
 
 //------------------------------------------------------------------------------
 struct FileCopier {
 public:
-   char buf[BUFSIZ];
-   unsigned bufs_per_update;
+   std::vector<char> buf;
    unsigned fsw;
-   CopyStatus status;
+   size_t chunk_bytes;       // bytes handed to an engine per call
+   FileSize::sizeType delta_bytes;  // smaller files aren't worth sending as a delta
+   CopyStatus& status;
+   FileStatus file;
    // when in safe mode no files are created, altered, or deleted
    bool safe_mode;
+   Durability durability;    // for exclusive copies
+   SyncBatch* batch;         // for durability other than None
+   bool preserve;            // copy mode, ownership, and times
+   bool xattrs;              // and extended attributes
+
+private:
+   CopyEngineList _engines;
+   unsigned _engine;         // index of the first engine this platform supports
+   std::vector<char> _bigBuf;     // for deltas and chunks
 
 public:
-   FileCopier (): bufs_per_update(512000), fsw(9), safe_mode(false) {}
-   FileCopier (bool safe): bufs_per_update(512000), fsw(9), safe_mode(safe) {}
-   void startBatch (unsigned nFiles, FileSize nBytes);
-   void copy (bfs::path const& srcpath, bfs::path const& dstpath, bfs::path const& dsppath);
+   FileCopier (CopyStatus& s, bool safe = false)
+   : fsw(9), chunk_bytes(1 << 23), delta_bytes(1 << 24), status(s), safe_mode(safe),
+     durability(Durability::None), batch(0), preserve(false), xattrs(false), _engine(0) {
+      makeCopyEngines("auto", _engines);
+      buf.resize(CopyEngineOptions().buffer_bytes);
+   }
+   bool setEngine (std::string const& name, bool clone = false, CopyEngineOptions const& options = CopyEngineOptions()) {
+      _engine = 0;
+      buf.resize(options.buffer_bytes);
+      return makeCopyEngines(name, _engines, clone, options);
+   }
+   bool copy (struct CopyTask const& t);
+   void copy (bfs::path const& srcpath, bfs::path const& dstpath, bfs::path const& dsppath, FileSize size);
+   void copy (bfs::path const& srcpath, bfs::path const& dstpath, bfs::path const& dsppath) {
+      copy(srcpath, dstpath, dsppath, file_size(srcpath));
+   }
    void copy (bfs::path const& srcpath, bfs::path const& dstpath) { copy(srcpath, dstpath, srcpath); }
+   bool copyDelta (bfs::path const& srcpath, bfs::path const& dstpath, bfs::path const& temppath,
+                   bfs::path const& dsppath, FileSize size, bool inplace);
+   bool copyChunk (struct CopyTask const& t);
+   bool copyFrom (struct CopyTask const& t, struct CopyTask const& original, bool clone);
 
 private:
-   void printStart  (CopyStatus const& s) const;
-   void printUpdate (CopyStatus const& s) const;
+   bool copyEngine (int src, int dst, bfs::path const& srcpath, bfs::path const& dstpath,
+                    off_t begin, off_t end, bool created);
+   void copyPread  (int src, int dst, bfs::path const& srcpath, bfs::path const& dstpath, off_t begin, off_t end);
+   void copyStream (bfs::path const& srcpath, bfs::path const& dstpath);
+   bool publish (struct CopyTask const& t, int fd, bfs::path const& target);
+   void addBytes (FileSize::sizeType n, bool cloned);
+   void addHole  (FileSize::sizeType n);
+   void printStart  () const;
+};
+
+//------------------------------------------------------------------------------
+// What the chunks of one file share: how many have yet to be finished, and the
+// temporary file they're copied into. That's removed once the last of them is
+// let go of unless it was published, so a file with a chunk that failed (or
+// that was never copied, the queue having been cancelled) isn't left behind.
+struct ChunkedFile {
+   std::atomic<unsigned> left;
+   std::atomic<bool> published;
+   bfs::path temp;
+
+   ChunkedFile (unsigned n, bfs::path const& t): left(n), published(false), temp(t) {}
+   ~ChunkedFile ();
+};
+
+//------------------------------------------------------------------------------
+// A file waiting to be copied, or a chunk of one: if chunks is set, this is the
+// range [begin, end) of a file that already exists at full size (as chunks->temp),
+// and chunks says how many of the file's chunks have yet to be finished. If the directories
+// holding src and dst are given they're used to open the files by name. An
+// exclusive copy won't replace an existing file, and is written as durably as
+// the FileCopier's durability asks; a chunked copy is always written to temp.
+// An update replaces dst by way of a temporary file
+// (see DirectoryComparer::replace).
+struct CopyTask {
+   bfs::path src;
+   bfs::path dst;
+   bfs::path dsp;
+   FileSize size;
+   off_t begin;
+   off_t end;
+   std::shared_ptr<ChunkedFile> chunks;
+   OpenDirPtr dir[2];
+   bool exclusive;
+   bool update;
+   bfs::path temp;
+};
+
+//------------------------------------------------------------------------------
+// Hands CopyTasks out to a pool of FileCopiers, balancing the work by bytes.
+// Files of at least large_bytes are handed out biggest first, but to no more
+// than half of the workers at a time; the other workers keep working through
+// the small files in the order they were queued. So a huge file never holds up
+// thousands of small ones, and the small ones keep their directory locality.
+// Chunks are bounded in size, so they're queued in order with the small files.
+//
+// Normally every task is pushed before start. A streaming queue is started
+// first and filled while the workers empty it: pop waits for more tasks until
+// close is called, and if capacity is set, push waits while that many tasks are
+// queued, so whoever is finding the tasks can't get far ahead of the copying.
+class CopyQueue {
+private:
+   std::vector<CopyTask> _large;   // sorted by size, handed out from the back
+   std::deque<CopyTask> _small;
+   unsigned _largeWorkers;
+   unsigned _maxLarge;
+   bool _open;                     // more tasks may still be pushed
+   bool _cancelled;
+   std::mutex _m;
+   std::condition_variable _changed;
+
+public:
+   FileSize::sizeType large_bytes;
+   size_t capacity;
+
+public:
+   CopyQueue (): _largeWorkers(0), _maxLarge(1), _open(false), _cancelled(false), large_bytes(1ul << 26), capacity(0) {}
+   void push (CopyTask const& t);
+   void start (unsigned jobs, bool streaming = false);
+   void close ();
+   bool pop (CopyTask& t, bool& large);
+   void done (bool large);
+   void cancel ();
 };
 
 
@@ -80,54 +309,79 @@ private:
 
 //------------------------------------------------------------------------------
 // A vector of files that keeps track of the combined size of its contents.
-class FileVector : public std::vector<bfs::path> {
+class FileVector : public std::vector<Entry> {
 protected:
    FileSize _bytes;
 
 public:
    FileVector (): _bytes(0) {}
 
-   void push_back (bfs::path const& p, bfs::path const& full) {
-      _bytes += file_size(full);
-      std::vector<bfs::path>::push_back(p);
-   }
-
-   template <typename Func>
-   void push_back (bfs::path const& p, Func grounder) {
-      push_back(p, grounder(p));
+   void push_back (Entry const& e) {
+      _bytes += e.size;
+      std::vector<Entry>::push_back(e);
    }
 
    void clear () {
       _bytes = 0;
-      std::vector<bfs::path>::clear();
+      std::vector<Entry>::clear();
    }
 
-   unsigned files () const { return std::vector<bfs::path>::size(); }
-   FileSize bytes () const { return _bytes; }
+   // drops the files for which gone is true
+   template <typename Pred> void removeIf (Pred gone) {
+      FileVector kept;
+      for (Entry const& e : *this) {
+         if (!gone(e)) kept.push_back(e);
+      }
+      *this = std::move(kept);
+   }
 
-// this method has no use in FileVector, so we're making it inaccessible
-private:
-   void push_back (bfs::path const& p) {}
+   // moves the contents of other onto the end of this vector
+   void append (FileVector& other) {
+      _bytes += other._bytes;
+      insert(end(), std::make_move_iterator(other.begin()), std::make_move_iterator(other.end()));
+      other.clear();
+   }
+
+   unsigned files () const { return std::vector<Entry>::size(); }
+   FileSize bytes () const { return _bytes; }
 };
 
 //------------------------------------------------------------------------------
 // A vector of directories that will tally the number and total size of all
 // children of its contents.
+//
+// Annotating walks each directory once and keeps everything it finds in a
+// manifest, so copying and deleting can work from memory instead of walking the
+// same subtrees again. The manifest lists the contents of each directory in
+// turn, every directory coming before its own contents, with paths relative to
+// the compared directories.
 class DirVector : public FileVector {
 private:
    unsigned _files;
+   PathArena _names;              // for the manifest's paths
+   std::vector<Entry> _manifest;
+   std::vector<size_t> _ends;     // _manifest[_ends[i-1], _ends[i]) lies in (*this)[i]
 
 public:
    DirVector (): _files(0) {}
 
-   void push_back (bfs::path const& p) { std::vector<bfs::path>::push_back(p); }
+   void push_back (Entry const& e) { std::vector<Entry>::push_back(e); }
    template <typename Func> void annotate (Func grounder);
+   // drops the directories, and things in the manifest, for which gone is true
+   // (along with the whole contents of any directory dropped)
+   template <typename Pred> void removeIf (Pred gone);
    unsigned files () const { return _files; }
 
-// these methods have no use in DirVector, so we're making them inaccessible
-private:
-   void push_back (bfs::path const& p, bfs::path const& full) {}
-   template <typename Func> void push_back (bfs::path const& p, Func grounder) {} 
+   void clear () {
+      FileVector::clear();
+      _files = 0;
+      _manifest.clear();
+      _ends.clear();
+   }
+
+   std::vector<Entry> const& manifest () const { return _manifest; }
+   size_t manifestBegin (unsigned i) const { return i ? _ends[i - 1] : 0; }
+   size_t manifestEnd   (unsigned i) const { return _ends[i]; }
 };
 
 //------------------------------------------------------------------------------
@@ -136,16 +390,16 @@ struct FDPair {
    FileVector f;
    DirVector  d;
 
-   void add (bfs::path const& p, bfs::path const& fullPath) {
-      if (is_regular_file(fullPath)) {
-         f.push_back(p, fullPath);
-      } else if (is_directory(fullPath)) {
-         d.push_back(p);
+   void add (Entry const& e) {
+      if (e.isFile()) {
+         f.push_back(e);
+      } else if (e.isDir()) {
+         d.push_back(e);
       }
    }
-   template <typename Func> void add (bfs::path const& p, Func grounder) { add(p, grounder(p)); }
 
    template <typename Func> void annotate (Func grounder) { d.annotate(grounder); }
+   void clear () { f.clear(); d.clear(); }
 
    unsigned ffiles () const { return f.files(); }
    FileSize fbytes () const { return f.bytes(); }
@@ -154,11 +408,58 @@ struct FDPair {
    unsigned files  () const { return ffiles() + dfiles(); }
    FileSize bytes  () const { return fbytes() + dbytes(); }
 
+   void append (FDPair& other) { f.append(other.f); d.append(other.d); }
+
    void fprint () const;
    void dprint () const;
    void print () const;
 };
 
+//------------------------------------------------------------------------------
+// A shared directory waiting to be compared, and the directory itself on each
+// side (opened by name in its parent when it's compared). When streaming, a
+// directory that's unique to A is also walked this way, to copy its contents.
+struct DirTask {
+   RelPath ext;
+   OpenDirPtr dir[2];
+   bool unique;
+   std::shared_ptr<PathNode const> name;  // ext's node, if it's one of its own
+};
+
+//------------------------------------------------------------------------------
+// Everything that comparing one or more pairs of directories turned up. Each
+// comparing thread fills its own Comparison; they're merged at the end.
+struct Comparison {
+   PathArena names; // for the paths of everything below
+   FDPair uc[2];    // files and directories unique to dir1 and dir2
+   FDPair sc;       // shared files and directories
+   FileVector sc1;  // the files in sc.f as found in dir2
+
+   std::vector<EntryPair> sizeIssues; // shared files with different sizes
+   std::vector<EntryPair> fdIssues;   // shared paths with file / directory mismatch
+   std::vector<EntryPair> modified;   // shared files that changed in dir1 (in update mode)
+
+   std::vector<Entry> temp1;
+   std::vector<Entry> temp2;
+
+   std::vector<CatalogEntry> dirs;    // compared directories, when keeping a catalog
+   unsigned skippedFiles;             // shared files in subtrees the catalog let us skip
+   FileSize skippedBytes;
+
+   Comparison (): skippedFiles(0), skippedBytes(0) {}
+
+   // forgets everything but the catalog records and skipped totals
+   void clearFound () {
+      uc[0].clear();
+      uc[1].clear();
+      sc.clear();
+      sc1.clear();
+      sizeIssues.clear();
+      fdIssues.clear();
+      modified.clear();
+   }
+};
+
 
 //==============================================================================
 // DirectoryComparer
@@ -170,6 +471,73 @@ struct FDPair {
  * In particular, the methods of this class are designed so that instead of
  * annotating all the files that will be copied (or deleted), you can copy and
  * delete as you explore into deeper and deeper directories.
+ *
+ * recursiveCompare runs compare on jobs threads. Shared subdirectories go into
+ * WorkStealingQueues rather than _sc.d, each thread records what it finds in its
+ * own Comparison, and these are merged into _uc, _sc, and the issue lists once
+ * every directory has been compared. Each queued directory carries OpenDirs for
+ * both sides, opened by name in its parent's, so the kernel never has to walk a
+ * full path; a directory stays open only until all its subdirectories are.
+ *
+ * With a catalog (see Catalog.h) a shared directory is only compared if it or
+ * something beneath it changed since the last run. Skipped subtrees contribute
+ * to the totals in the outline, but their files aren't listed individually.
+ * Verifying needs every shared file, and so does updating (a file rewritten in
+ * place leaves its directory's mtime alone), so the catalog isn't used for
+ * skipping in either mode.
+ *
+ * Shared files are taken to be backed up when their sizes match. With verify
+ * mode on, their contents are hashed on both sides as well (see verify), and
+ * any that differ are moved from _sc.f to _contentIssues.
+ *
+ * In update mode, shared files that changed in A are listed in _modified rather
+ * than treated as backed up or in conflict: those whose sizes differ, those
+ * whose contents differ when verifying, and otherwise those modified in A more
+ * recently than in B. Copying then rewrites them in B (see update), each one
+ * going to a temporary file that is renamed over the old copy once complete, so
+ * B always holds either the old version or the new one.
+ *
+ * In delta mode large files are updated by delta transfer instead, which reads
+ * both copies but writes only what changed. With inplace mode on, a delta that
+ * doesn't move any blocks is written straight into B's copy (unless that copy
+ * has other names, which would all change with it); if that's interrupted the
+ * file is left half updated, and only verifying will notice.
+ *
+ * In stream mode backup does all of this as it goes (see stream): each
+ * directory's differences are acted on as soon as it's compared, copies go
+ * through a CopyQueue of bounded size to a second pool of threads, and
+ * directories unique to A are walked rather than annotated. Only the names of
+ * directories waiting to be compared and of those above them are kept, each
+ * freed once nothing below it is waiting, so memory doesn't grow with the size
+ * of the tree (except for catalog records, if keeping a catalog), and copying
+ * starts right away. Totals
+ * aren't known until the end, so progress is shown against what's been found.
+ * Verifying needs every shared file before it can start, so it isn't streamed.
+ *
+ * In move mode (when copying and deleting) files unique to A are looked for
+ * among those unique to B before anything is copied, and those found are moved
+ * (renamed) within B instead; see moves. Where a whole directory unique to A is
+ * found in B under another name, the directory is moved in one go. Streaming
+ * has no list of what's unique to B to search, so doesn't look for moves.
+ *
+ * Files in A with several names (hard links) are copied once in links mode,
+ * and their other names in B are made links to that copy. Dedup mode goes
+ * further: files to be copied that have the same size are hashed, and any whose
+ * hash matches one copied before them, and whose contents do too when compared
+ * byte for byte, is linked to (or cloned from) its copy instead of being written
+ * again. Either way the links are made once all the copying is done; see
+ * findDuplicates. Streaming doesn't do either.
+ *
+ * Deleting is done by jobs workers at once, bottom up (see del), and counts the
+ * sizes found when annotating. With delete_first set it happens before copying
+ * (but after moves, which would otherwise be deleted) to make room in B.
+ *
+ * In preserve mode copies keep their originals' metadata (see FileCopier), and
+ * once a backup is done every directory in B whose contents we changed is given
+ * the metadata of its counterpart in A (see fixDirectories).
+ *
+ * With adaptive_ms set, no more than jobs copiers copy at once, and fewer if
+ * the source's reads are taking longer than adaptive_ms (see AdaptiveLimit).
  */
 
 //------------------------------------------------------------------------------
@@ -179,29 +547,85 @@ private:
    static const unsigned A1 = 0x2;
    static const unsigned AM = 0x4;
    static const unsigned RC = 0x8;
+   static const unsigned VF = 0x10;
 
 private:
    bfs::path _p[2];
    bfs::path _extension;
+   PathArena _names;  // for the paths in everything below, once merged
 
    FDPair _uc[2];    // files and directories unique to dir1 and dir2
    FDPair _sc;       // shared files and directories
+   FileVector _sc1;  // the files in _sc.f as found in dir2
 
-   std::vector<bfs::path> _sizeIssues; // shared files with different sizes
-   std::vector<bfs::path> _fdIssues;   // shared paths with file / directory mismatch
+   std::vector<EntryPair> _sizeIssues;    // shared files with different sizes
+   std::vector<EntryPair> _fdIssues;      // shared paths with file / directory mismatch
+   std::vector<EntryPair> _contentIssues; // shared files with the same size but different contents
+   std::vector<EntryPair> _modified;      // shared files that changed in dir1 (in update mode)
 
-   std::vector<bfs::path> _temp1;
-   std::vector<bfs::path> _temp2;
+   std::unique_ptr<Catalog> _catalog;  // what was backed up last time, if we know
+   std::vector<CatalogEntry> _dirs;    // what is backed up now
+   unsigned _skippedFiles;
+   FileSize _skippedBytes;
 
    unsigned _annotations;
 
    bool ignore_hidden_files;
    // when in safe mode no files are created, altered, or deleted
    bool safe_mode;
+   std::string copy_engine;
+   CopyEngineOptions engine_options;
+   bool clone_mode;
+   unsigned jobs;
+   bfs::path catalog_file;
+   FileSize::sizeType split_bytes;  // files this big are copied in chunks by several workers
+   bool verify_mode;
+   bfs::path hash_cache_file;
+   bool update_mode;
+   bool delta_mode;
+   bool inplace_mode;
+   bool stream_mode;
+   size_t stream_tasks;  // copies queued at most, when streaming
+   Durability durability;
+   bool preserve_mode;
+   bool xattr_mode;
+   bool move_mode;
+   FileSize::sizeType move_bytes;  // smaller files are just copied
+   bool links_mode;
+   Dedup dedup;
+   bool delete_first;  // delete before copying, to make room
+   unsigned progress_ms;  // between progress reports while copying or deleting (0 for none)
+   double adaptive_ms;    // target source read latency for adaptive copying (0 for fixed jobs)
+
+   std::set<std::string> _touched;  // directories in B we've changed (when preserving)
+   std::mutex _touchedMutex;
 
 public:
-   DirectoryComparer (): _extension(""), _annotations(0), ignore_hidden_files(true) {}
+   DirectoryComparer ()
+   : _extension(""), _skippedFiles(0), _skippedBytes(0), _annotations(0), ignore_hidden_files(true),
+     copy_engine("auto"), clone_mode(false), jobs(1), split_bytes(1ul << 30), verify_mode(false), update_mode(false),
+     delta_mode(false), inplace_mode(false), stream_mode(false), stream_tasks(4096),
+     durability(Durability::None), preserve_mode(false), xattr_mode(false),
+     move_mode(false), move_bytes(1 << 20), links_mode(false), dedup(Dedup::None),
+     delete_first(false), progress_ms(2000), adaptive_ms(0) {}
    void setSafeMode (bool safe) { safe_mode = safe; }
+   void setCopyEngine (std::string const& name) { copy_engine = name; }
+   void setEngineOptions (CopyEngineOptions const& options) { engine_options = options; }
+   void setCloneMode (bool clone) { clone_mode = clone; }
+   void setJobs (unsigned n) { jobs = n ? n : 1; }
+   void setSplitSize (FileSize::sizeType bytes) { split_bytes = bytes; }
+   void setCatalog (bfs::path const& file) { catalog_file = file; }
+   void setVerify (bool verify, bfs::path const& cache) { verify_mode = verify; hash_cache_file = cache; }
+   void setUpdateMode (bool update) { update_mode = update; }
+   void setDeltaMode (bool delta, bool inplace) { delta_mode = delta; inplace_mode = inplace; }
+   void setStreamMode (bool stream) { stream_mode = stream; }
+   void setDurability (Durability d) { durability = d; }
+   void setPreserve (bool preserve, bool xattrs) { preserve_mode = preserve; xattr_mode = preserve && xattrs; }
+   void setMoveMode (bool moves) { move_mode = moves; }
+   void setLinks (bool links, Dedup d) { links_mode = links; dedup = d; }
+   void setDeleteFirst (bool first) { delete_first = first; }
+   void setProgressInterval (unsigned ms) { progress_ms = ms; }
+   void setAdaptive (double targetMs) { adaptive_ms = targetMs; }
    void setPaths (bfs::path const& p0, bfs::path const& p1) {
       _p[0] = p0;
       _p[1] = p1;
@@ -216,43 +640,34 @@ private:
    bfs::path relPath     (bfs::path const& p)             const { return _extension / p; }
    bfs::path fullPath    (bfs::path const& p, unsigned n) const { return _p[n] / _extension / p; }
    bfs::path groundPath  (bfs::path const& e, unsigned n) const { return _p[n] / e; }
-
-   void compare ();
+   bfs::path groundPath  (RelPath const& e, unsigned n)   const { return _p[n] / e.string(); }
+
+   void compare (DirTask const& t, Comparison& c) const;
+   void prepare (FileCopier& copier, SyncBatch& batch) const;
+   void touch (RelPath const& rel);
+   void fixDirectories ();
+   void openCatalog ();
+   bool skipCatalogued (DirTask const& t, Comparison& c) const;
+   void closeCatalog ();
    void recursiveCompare ();
+   void merge (Comparison& c);
+   void verify ();
+   void moves ();
    inline void annotate0 ();
    inline void annotate1 ();
    inline void annotateMutual ();
+   bool queueCopy (CopyQueue& queue, CopyTask const& t) const;
+   void findDuplicates (std::unordered_map<Entry const*, Entry const*>& sameAs);
    void copy ();
+   void update ();
+   void replace (FileCopier& copier, CopyTask const& t) const;
    void del ();
+   void stream (bool c, bool d);
 
    void print0       () const;
    void print1       () const;
+   void printModified () const;
    void printShared  () const;
    void printIssues  () const;
    void printOutline () const;
 };
-
-//------------------------------------------------------------------------------
-void DirectoryComparer::annotate0 () {
-   if (!(_annotations & A0)) {
-      _uc[0].d.annotate([this] (bfs::path const& p) { return groundPath(p, 0); });
-      _annotations |= A0;
-   }
-}
-
-//------------------------------------------------------------------------------
-void DirectoryComparer::annotate1 () {
-   if (!(_annotations & A1)) {
-      _uc[1].d.annotate([this] (bfs::path const& p) { return groundPath(p, 1); });
-      _annotations |= A1;
-   }
-}
-
-//------------------------------------------------------------------------------
-void DirectoryComparer::annotateMutual () {
-   if (!(_annotations & AM)) {
-      _sc.d.annotate([this] (bfs::path const& p) { return groundPath(p, 0); });
-      _annotations |= AM;
-   }
-}
-
@@ -0,0 +1,282 @@
+//==============================================================================
+// Catalog.cpp
+// created October 16, 2026
+//==============================================================================
+
+#include "Catalog.h"
+#include "Workers.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+struct Catalog::Header {
+   char magic[8];
+   uint32_t version;
+   uint32_t count;            // number of records
+   uint64_t rootOffset[2];    // paths of A and B, in the string table
+   uint32_t rootLength[2];
+};
+
+//------------------------------------------------------------------------------
+struct Catalog::Record {
+   uint64_t pathOffset;       // in the string table
+   uint32_t pathLength;
+   uint32_t files;
+   uint64_t bytes;
+   int64_t sec[2];
+   int64_t nsec[2];
+};
+
+static char const magic[8] = { 'B', 'K', 'C', 'A', 'T', 'L', 'G', '\0' };
+static const uint32_t version = 1;
+
+//------------------------------------------------------------------------------
+static string rootString (bfs::path const& p) {
+   return bfs::absolute(p).lexically_normal().string();
+}
+
+//------------------------------------------------------------------------------
+// Whether [offset, offset + length) lies within a string table of size bytes,
+// written so that a corrupt offset can't overflow its way past the check.
+static bool inTable (uint64_t offset, uint64_t length, size_t size) {
+   return offset <= size && length <= size - offset;
+}
+
+//------------------------------------------------------------------------------
+// The path one level up from p, where "" is the top.
+static string parentOf (string const& p) {
+   size_t slash = p.rfind('/');
+   return slash == string::npos ? string() : p.substr(0, slash);
+}
+
+
+//==============================================================================
+// Catalog
+//==============================================================================
+
+//------------------------------------------------------------------------------
+Catalog::Catalog (): _fd(-1), _map(0), _size(0), _header(0), _records(0), _strings(0) {}
+
+//------------------------------------------------------------------------------
+Catalog::~Catalog () {
+   if (_map) munmap(_map, _size);
+   if (_fd >= 0) close(_fd);
+}
+
+//------------------------------------------------------------------------------
+bool Catalog::open (bfs::path const& file, bfs::path const& a, bfs::path const& b) {
+   _fd = ::open(file.c_str(), O_RDONLY);
+   if (_fd < 0) return false;
+
+   struct stat st;
+   if (fstat(_fd, &st) != 0 || size_t(st.st_size) < sizeof(Header)) return false;
+   _size = st.st_size;
+   _map = mmap(0, _size, PROT_READ, MAP_SHARED, _fd, 0);
+   if (_map == MAP_FAILED) {
+      _map = 0;
+      return false;
+   }
+
+   // check that this catalog is sane and belongs to these directories, and that
+   // every path in it is within the file (so a corrupt one is rejected here,
+   // rather than read past the end of the mapping later)
+   Header const* h = static_cast<Header const*>(_map);
+   size_t stringStart = sizeof(Header) + size_t(h->count) * sizeof(Record);
+   if (memcmp(h->magic, magic, sizeof(magic)) || h->version != version || stringStart > _size) return false;
+   size_t tableSize = _size - stringStart;
+   _strings = static_cast<char const*>(_map) + stringStart;
+   string roots[2] = { rootString(a), rootString(b) };
+   for (unsigned n=0; n<2; ++n) {
+      if (!inTable(h->rootOffset[n], h->rootLength[n], tableSize) ||
+          roots[n].compare(0, string::npos, _strings + h->rootOffset[n], h->rootLength[n])) {
+         return false;
+      }
+   }
+   Record const* records = reinterpret_cast<Record const*>(static_cast<char const*>(_map) + sizeof(Header));
+   for (uint32_t i=0; i<h->count; ++i) {
+      if (!inTable(records[i].pathOffset, records[i].pathLength, tableSize)) return false;
+   }
+   _header = h;
+   _records = records;
+   _unchanged.assign(count(), 0);
+   return true;
+}
+
+//------------------------------------------------------------------------------
+void Catalog::check (bfs::path const& a, bfs::path const& b, unsigned jobs) {
+   // which directories themselves are unchanged
+   unsigned n = count();
+   runWorkers(jobs, [&] (unsigned id) {
+      struct stat st;
+      for (unsigned i=id; i<n; i+=jobs) {
+         string p = pathOf(i);
+         bool same = true;
+         for (unsigned side=0; side<2 && same; ++side) {
+            bfs::path full = (side ? b : a) / p;
+            same = stat(full.c_str(), &st) == 0 && S_ISDIR(st.st_mode) &&
+                   st.st_mtim.tv_sec == _records[i].sec[side] && st.st_mtim.tv_nsec == _records[i].nsec[side];
+         }
+         _unchanged[i] = same;
+      }
+   });
+
+   // a change anywhere in a subtree means the subtree has changed
+   vector<unsigned> changed;
+   for (unsigned i=0; i<n; ++i) {
+      if (!_unchanged[i]) changed.push_back(i);
+   }
+   for (unsigned i : changed) {
+      string p = pathOf(i);
+      while (p.size()) {
+         p = parentOf(p);
+         unsigned j = find(p);
+         if (j == n || !_unchanged[j]) break;  // and so are its ancestors
+         _unchanged[j] = 0;
+      }
+   }
+}
+
+//------------------------------------------------------------------------------
+bool Catalog::skip (bfs::path const& ext, vector<CatalogEntry>& out) const {
+   string p = ext.string();
+   unsigned i = find(p);
+   if (i == count() || !_unchanged[i]) return false;
+
+   // everything beneath p starts with p + '/', so lies between p + '/' and p + '0'
+   out.push_back(entry(i));
+   unsigned begin = p.empty() ? 0 : lowerBound(p + '/');
+   unsigned end = p.empty() ? count() : lowerBound(p + '0');
+   for (unsigned j=begin; j<end; ++j) {
+      if (j != i) out.push_back(entry(j));
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+void Catalog::write (bfs::path const& file, bfs::path const& a, bfs::path const& b,
+                     vector<CatalogEntry>& entries) {
+   sort(entries.begin(), entries.end(), [] (CatalogEntry const& x, CatalogEntry const& y) {
+      return x.path < y.path;
+   });
+
+   // a directory is only clean if everything beneath it is
+   auto find = [&entries] (string const& p) -> CatalogEntry* {
+      auto itr = lower_bound(entries.begin(), entries.end(), p, [] (CatalogEntry const& e, string const& s) {
+         return e.path < s;
+      });
+      return itr != entries.end() && itr->path == p ? &*itr : 0;
+   };
+   for (size_t i=0; i<entries.size(); ++i) {
+      if (entries[i].clean) continue;
+      string p = entries[i].path;
+      while (p.size()) {
+         p = parentOf(p);
+         CatalogEntry* e = find(p);
+         if (!e || !e->clean) break;
+         e->clean = false;
+      }
+   }
+
+   // lay out the header, records, and strings
+   Header h;
+   memcpy(h.magic, magic, sizeof(magic));
+   h.version = version;
+   h.count = 0;
+   string strings;
+   string roots[2] = { rootString(a), rootString(b) };
+   for (unsigned n=0; n<2; ++n) {
+      h.rootOffset[n] = strings.size();
+      h.rootLength[n] = roots[n].size();
+      strings += roots[n];
+   }
+   vector<Record> records;
+   for (CatalogEntry const& e : entries) {
+      if (!e.clean) continue;
+      Record r;
+      r.pathOffset = strings.size();
+      r.pathLength = e.path.size();
+      r.files = e.files;
+      r.bytes = e.bytes;
+      for (unsigned n=0; n<2; ++n) {
+         r.sec[n] = e.mtime[n].tv_sec;
+         r.nsec[n] = e.mtime[n].tv_nsec;
+      }
+      records.push_back(r);
+      strings += e.path;
+   }
+   h.count = records.size();
+
+   // write to the side and rename, so a mapped old catalog is never disturbed
+   bfs::path temp = file.string() + ".tmp";
+   {
+      ofstream out(temp.c_str(), ios_base::out | ios_base::binary | ios_base::trunc);
+      out.write(reinterpret_cast<char const*>(&h), sizeof(h));
+      out.write(reinterpret_cast<char const*>(records.data()), records.size() * sizeof(Record));
+      out.write(strings.data(), strings.size());
+      if (!out) {
+         throw bfs::filesystem_error("write", temp, boost::system::error_code(EIO, boost::system::system_category()));
+      }
+   }
+   bfs::rename(temp, file);
+}
+
+//------------------------------------------------------------------------------
+unsigned Catalog::count () const {
+   return _header ? _header->count : 0;
+}
+
+//------------------------------------------------------------------------------
+string Catalog::pathOf (unsigned i) const {
+   return string(_strings + _records[i].pathOffset, _records[i].pathLength);
+}
+
+//------------------------------------------------------------------------------
+// Index of the record for p, or count() if there isn't one.
+unsigned Catalog::find (string const& p) const {
+   unsigned i = lowerBound(p);
+   return i < count() && !p.compare(0, string::npos, _strings + _records[i].pathOffset, _records[i].pathLength)
+        ? i : count();
+}
+
+//------------------------------------------------------------------------------
+// Index of the first record whose path isn't less than p.
+unsigned Catalog::lowerBound (string const& p) const {
+   unsigned lo = 0;
+   unsigned hi = count();
+   while (lo < hi) {
+      unsigned mid = lo + (hi - lo) / 2;
+      if (p.compare(0, string::npos, _strings + _records[mid].pathOffset, _records[mid].pathLength) > 0) {
+         lo = mid + 1;
+      } else {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+//------------------------------------------------------------------------------
+CatalogEntry Catalog::entry (unsigned i) const {
+   CatalogEntry e;
+   e.path = pathOf(i);
+   e.files = _records[i].files;
+   e.bytes = _records[i].bytes;
+   for (unsigned n=0; n<2; ++n) {
+      e.mtime[n].tv_sec = _records[i].sec[n];
+      e.mtime[n].tv_nsec = _records[i].nsec[n];
+   }
+   e.clean = true;
+   return e;
+}
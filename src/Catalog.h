@@ -0,0 +1,84 @@
+//==============================================================================
+// Catalog.h
+// created October 16, 2026
+//==============================================================================
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <boost/filesystem.hpp>
+
+namespace bfs = boost::filesystem;
+
+
+//------------------------------------------------------------------------------
+/*
+ * Note: A Catalog remembers, from one run to the next, which directories were
+ * completely backed up: for each such directory (shared by A and B, with nothing
+ * unique or in conflict anywhere beneath it) it records the modification time on
+ * each side, and the number and total size of the shared files directly inside.
+ *
+ * Adding, removing, or renaming anything in a directory changes its mtime, so if
+ * a directory and every catalogued directory beneath it have the same mtimes as
+ * last time, the whole subtree is still backed up and need not be read again.
+ * (Editing a file in place doesn't change its directory's mtime, so a catalog
+ * won't notice a file whose size changed. Don't use one if that matters.)
+ *
+ * On disk the catalog is a header, an array of CatalogRecords sorted by path,
+ * and a table of path strings. It is memory-mapped, so loading costs nothing
+ * until a directory is looked up, and it is rewritten after each comparison.
+ */
+
+//------------------------------------------------------------------------------
+// A directory as remembered by the catalog (or about to be).
+struct CatalogEntry {
+   std::string path;          // relative to the compared directories ("" for the top)
+   struct timespec mtime[2];  // in A and B
+   uint32_t files;            // shared files directly in this directory
+   uint64_t bytes;            // and their combined size
+   bool clean;                // nothing here is unique to A or B, or in conflict
+};
+
+//------------------------------------------------------------------------------
+class Catalog {
+public:
+   struct Header;
+   struct Record;
+
+private:
+   int _fd;
+   void* _map;
+   size_t _size;
+   Header const* _header;
+   Record const* _records;
+   char const* _strings;
+   std::vector<char> _unchanged;   // record i and everything beneath it are unchanged
+
+public:
+   Catalog ();
+   ~Catalog ();
+
+   // Maps the catalog in file. Returns false (and the catalog stays empty) if
+   // there is no such file or it was written for a different pair of directories.
+   bool open (bfs::path const& file, bfs::path const& a, bfs::path const& b);
+
+   // Stats every catalogued directory in a and b (using jobs threads) to find
+   // out which subtrees are unchanged.
+   void check (bfs::path const& a, bfs::path const& b, unsigned jobs);
+
+   // If ext and everything beneath it are unchanged, appends the catalogued
+   // entries for that subtree to out and returns true.
+   bool skip (bfs::path const& ext, std::vector<CatalogEntry>& out) const;
+
+   // Writes the clean subtrees among entries (which is sorted in the process).
+   static void write (bfs::path const& file, bfs::path const& a, bfs::path const& b,
+                      std::vector<CatalogEntry>& entries);
+
+private:
+   unsigned count () const;
+   std::string pathOf (unsigned i) const;
+   unsigned find (std::string const& p) const;
+   unsigned lowerBound (std::string const& p) const;
+   CatalogEntry entry (unsigned i) const;
+};
@@ -0,0 +1,427 @@
+//==============================================================================
+// CopyEngine.cpp
+// created October 16, 2026
+//==============================================================================
+
+#include "CopyEngine.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+#endif
+
+using namespace std;
+
+
+//==============================================================================
+// CopyEngine
+//==============================================================================
+
+//------------------------------------------------------------------------------
+bool CopyEngine::unsupported (int err) {
+   return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP ||
+          err == ENOTSUP || err == EBADF || err == ENOTTY;
+}
+
+#ifdef __linux__
+
+//------------------------------------------------------------------------------
+// Ranges must be block aligned, except that the last one may end at EOF. Our
+// chunks are multiples of any sensible block size, so that works out.
+long CloneEngine::transfer (int src, int dst, off_t off, size_t len) {
+   struct file_clone_range range;
+   range.src_fd = src;
+   range.src_offset = off;
+   range.src_length = len;
+   range.dest_offset = off;
+   if (ioctl(dst, FICLONERANGE, &range) < 0) return -1;
+   return len;
+}
+
+//------------------------------------------------------------------------------
+long CopyFileRangeEngine::transfer (int src, int dst, off_t off, size_t len) {
+   loff_t in = off;
+   loff_t out = off;
+   return copy_file_range(src, &in, dst, &out, len, 0);
+}
+
+//------------------------------------------------------------------------------
+long SendfileEngine::transfer (int src, int dst, off_t off, size_t len) {
+   if (lseek(dst, off, SEEK_SET) < 0) return -1;
+   return sendfile(dst, src, &off, len);
+}
+
+//------------------------------------------------------------------------------
+SpliceEngine::SpliceEngine (): _pipeSize(0) {
+   if (pipe(_pipe) == 0) {
+      // a bigger pipe means fewer round trips; the kernel may refuse (or cap) this
+      fcntl(_pipe[1], F_SETPIPE_SZ, 1 << 20);
+      long size = fcntl(_pipe[1], F_GETPIPE_SZ);
+      _pipeSize = size > 0 ? size : 1 << 16;
+   } else {
+      _pipe[0] = _pipe[1] = -1;
+   }
+}
+
+//------------------------------------------------------------------------------
+SpliceEngine::~SpliceEngine () {
+   if (_pipe[0] >= 0) close(_pipe[0]);
+   if (_pipe[1] >= 0) close(_pipe[1]);
+}
+
+//------------------------------------------------------------------------------
+long SpliceEngine::transfer (int src, int dst, off_t off, size_t len) {
+   if (_pipe[0] < 0) {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   loff_t in = off;
+   loff_t out = off;
+   long filled = splice(src, &in, _pipe[1], NULL, min(len, _pipeSize), SPLICE_F_MOVE);
+   if (filled <= 0) return filled;
+
+   // drain everything we put in the pipe, or the next call will be confused
+   long drained = 0;
+   while (drained < filled) {
+      long n = splice(_pipe[0], NULL, dst, &out, filled - drained, SPLICE_F_MOVE);
+      if (n <= 0) {
+         if (n < 0 && errno == EINTR) continue;
+         if (n == 0) errno = EIO;
+         return -1;
+      }
+      drained += n;
+   }
+   return filled;
+}
+
+//==============================================================================
+// UringEngine
+//==============================================================================
+
+#ifdef __NR_io_uring_setup
+
+//------------------------------------------------------------------------------
+// A buffer and the piece of the file it's carrying.
+struct Slot {
+   off_t off;
+   size_t len;
+   size_t done;       // bytes written so far
+   bool busy;
+   bool writing;
+};
+
+//------------------------------------------------------------------------------
+// The rings shared with the kernel, and our buffers.
+struct UringEngine::Ring {
+   int fd;
+   unsigned entries;
+   void* sqMap;
+   size_t sqMapSize;
+   void* cqMap;
+   size_t cqMapSize;
+   io_uring_sqe* sqes;
+   size_t sqesSize;
+   unsigned* sqHead;
+   unsigned* sqTail;
+   unsigned* sqMask;
+   unsigned* sqArray;
+   unsigned* cqHead;
+   unsigned* cqTail;
+   unsigned* cqMask;
+   io_uring_cqe* cqes;
+
+   size_t bufferBytes;
+   std::vector<char*> buffers;
+   std::vector<iovec> iovecs;
+   std::vector<Slot> slots;
+   bool fixed;                   // buffers are registered
+
+   Ring (): fd(-1), sqMap(MAP_FAILED), cqMap(MAP_FAILED), sqes(0) {}
+   ~Ring ();
+   bool setup (CopyEngineOptions const& options);
+   void queue (unsigned i, bool write, int fd, off_t off, size_t len, size_t from);
+   bool enter (unsigned wait);
+};
+
+//------------------------------------------------------------------------------
+UringEngine::Ring::~Ring () {
+   if (sqes) munmap(sqes, sqesSize);
+   if (cqMap != MAP_FAILED && cqMap != sqMap) munmap(cqMap, cqMapSize);
+   if (sqMap != MAP_FAILED) munmap(sqMap, sqMapSize);
+   if (fd >= 0) close(fd);
+   for (char* b : buffers) free(b);
+}
+
+//------------------------------------------------------------------------------
+// Returns false, with errno set, if there's no io_uring to be had.
+bool UringEngine::Ring::setup (CopyEngineOptions const& options) {
+   entries = max(1u, options.queue_depth);
+   io_uring_params p;
+   memset(&p, 0, sizeof(p));
+   fd = syscall(__NR_io_uring_setup, entries, &p);
+   if (fd < 0) {
+      if (errno == EPERM) errno = ENOSYS;  // disabled by sysctl or seccomp
+      return false;
+   }
+
+   // map the rings (one mapping serves both on newer kernels)
+   sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+   bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+   if (single) sqMapSize = cqMapSize = max(sqMapSize, cqMapSize);
+   sqMap = mmap(0, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+   if (sqMap == MAP_FAILED) return false;
+   cqMap = single ? sqMap : mmap(0, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+   if (cqMap == MAP_FAILED) return false;
+   sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+   void* m = mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+   if (m == MAP_FAILED) return false;
+   sqes = static_cast<io_uring_sqe*>(m);
+
+   char* sq = static_cast<char*>(sqMap);
+   char* cq = static_cast<char*>(cqMap);
+   sqHead  = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+   sqTail  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+   sqMask  = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+   sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+   cqHead  = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+   cqTail  = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+   cqMask  = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+   cqes    = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+   // page aligned buffers, so they also do for O_DIRECT
+   bufferBytes = (max<size_t>(options.buffer_bytes, 4096) + 4095) & ~size_t(4095);
+   for (unsigned i=0; i<entries; ++i) {
+      void* b;
+      if (posix_memalign(&b, 4096, bufferBytes) != 0) {
+         errno = ENOMEM;
+         return false;
+      }
+      buffers.push_back(static_cast<char*>(b));
+      iovecs.push_back(iovec{ b, bufferBytes });
+   }
+   slots.assign(entries, Slot());
+
+   // registered buffers save pinning pages on every request, but count against
+   // RLIMIT_MEMLOCK; without them we use plain readv and writev
+   fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecs.data(), entries) == 0;
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Queues a read into (or a write from) buffer i, starting from byte `from` of it.
+void UringEngine::Ring::queue (unsigned i, bool write, int file, off_t off, size_t len, size_t from) {
+   unsigned tail = *sqTail;
+   unsigned index = tail & *sqMask;
+   io_uring_sqe* sqe = sqes + index;
+   memset(sqe, 0, sizeof(*sqe));
+   sqe->fd = file;
+   sqe->off = off;
+   sqe->user_data = i;
+   if (fixed) {
+      sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe->addr = reinterpret_cast<uint64_t>(buffers[i] + from);
+      sqe->len = len;
+      sqe->buf_index = i;
+   } else {
+      sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+      iovecs[i].iov_base = buffers[i] + from;
+      iovecs[i].iov_len = len;
+      sqe->addr = reinterpret_cast<uint64_t>(&iovecs[i]);
+      sqe->len = 1;
+   }
+   sqArray[index] = index;
+   __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+//------------------------------------------------------------------------------
+// Submits everything queued and waits for at least wait completions.
+bool UringEngine::Ring::enter (unsigned wait) {
+   while (true) {
+      unsigned pending = *sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+      long r = syscall(__NR_io_uring_enter, fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      if (r >= 0) return true;
+      if (errno != EINTR) return false;
+   }
+}
+
+//------------------------------------------------------------------------------
+UringEngine::UringEngine (CopyEngineOptions const& options): _options(options) {}
+
+//------------------------------------------------------------------------------
+UringEngine::~UringEngine () {}
+
+//------------------------------------------------------------------------------
+long UringEngine::transfer (int src, int dst, off_t off, size_t len) {
+   if (!_ring) {
+      std::unique_ptr<Ring> ring(new Ring());
+      if (!ring->setup(_options)) return -1;
+      _ring = std::move(ring);
+   }
+
+   // O_DIRECT only works in whole blocks, so the unaligned tail of a file goes
+   // through the page cache on the next call
+   struct stat st;
+   if (_options.direct && !(off & 4095) && fstat(src, &st) == 0 && st.st_size >= _options.direct_bytes &&
+       st.st_size - off >= 4096) {
+      size_t aligned = min<off_t>(len, st.st_size - off) & ~off_t(4095);
+      int srcFlags = fcntl(src, F_GETFL);
+      int dstFlags = fcntl(dst, F_GETFL);
+      if (fcntl(src, F_SETFL, srcFlags | O_DIRECT) == 0) {
+         if (fcntl(dst, F_SETFL, dstFlags | O_DIRECT) == 0) {
+            long n = pipeline(src, dst, off, aligned);
+            int err = errno;
+            fcntl(dst, F_SETFL, dstFlags);
+            fcntl(src, F_SETFL, srcFlags);
+            errno = err;
+            return n;
+         }
+         fcntl(src, F_SETFL, srcFlags);
+      }
+      // this filesystem can't do O_DIRECT; carry on without it
+   }
+   return pipeline(src, dst, off, len);
+}
+
+//------------------------------------------------------------------------------
+// Reads [off, off + len) into every free buffer, writes each buffer out as its
+// read completes, and refills it, until the range (or the file) is done.
+long UringEngine::pipeline (int src, int dst, off_t off, size_t len) {
+   Ring& r = *_ring;
+   off_t next = off;
+   off_t end = off + len;   // moves back if the file turns out to be shorter
+   unsigned inflight = 0;
+   int error = 0;
+
+   while (true) {
+      for (unsigned i=0; i<r.entries && next < end && !error; ++i) {
+         Slot& s = r.slots[i];
+         if (s.busy) continue;
+         s.off = next;
+         s.len = min<off_t>(r.bufferBytes, end - next);
+         s.done = 0;
+         s.busy = true;
+         s.writing = false;
+         r.queue(i, false, src, s.off, s.len, 0);
+         next += s.len;
+         ++inflight;
+      }
+      if (!inflight) break;
+
+      if (!r.enter(1)) {
+         // we can't tell what the kernel still has in hand, so start over next time
+         int err = errno;
+         _ring.reset();
+         errno = err;
+         return -1;
+      }
+
+      unsigned head = *r.cqHead;
+      unsigned tail = __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head) {
+         io_uring_cqe const& cqe = r.cqes[head & *r.cqMask];
+         Slot& s = r.slots[cqe.user_data];
+         int res = cqe.res;
+         if (res < 0 || (s.writing && res == 0)) {
+            if (!error) error = res < 0 ? -res : EIO;
+            s.busy = false;
+            --inflight;
+         } else if (!s.writing) {
+            // a short read is the end of the file
+            if (size_t(res) < s.len) end = min<off_t>(end, s.off + res);
+            if (res == 0 || error) {
+               s.busy = false;
+               --inflight;
+               continue;
+            }
+            s.len = res;
+            s.writing = true;
+            r.queue(cqe.user_data, true, dst, s.off, s.len, 0);
+         } else {
+            s.done += res;
+            if (s.done < s.len) {
+               r.queue(cqe.user_data, true, dst, s.off + s.done, s.len - s.done, s.done);
+            } else {
+               s.busy = false;
+               --inflight;
+            }
+         }
+      }
+      __atomic_store_n(r.cqHead, head, __ATOMIC_RELEASE);
+   }
+
+   if (error) {
+      errno = error;
+      return -1;
+   }
+   return end - off;
+}
+
+#else
+
+struct UringEngine::Ring {};
+UringEngine::UringEngine (CopyEngineOptions const& options): _options(options) {}
+UringEngine::~UringEngine () {}
+long UringEngine::transfer (int, int, off_t, size_t) { errno = ENOSYS; return -1; }
+long UringEngine::pipeline (int, int, off_t, size_t) { errno = ENOSYS; return -1; }
+
+#endif
+
+
+//------------------------------------------------------------------------------
+bool makeCopyEngines (string const& name, CopyEngineList& engines, bool clone, CopyEngineOptions const& options) {
+   engines.clear();
+   if (clone) {
+      engines.emplace_back(new CloneEngine());
+   }
+   if (name == "auto" || name == "copy_file_range") {
+      engines.emplace_back(new CopyFileRangeEngine());
+   }
+   if (name == "auto" || name == "sendfile") {
+      engines.emplace_back(new SendfileEngine());
+   }
+   if (name == "auto" || name == "splice") {
+      engines.emplace_back(new SpliceEngine());
+   }
+   if (name == "io_uring") {
+      engines.emplace_back(new UringEngine(options));
+   }
+   return engines.size() > unsigned(clone) || name == "stream";
+}
+
+#else
+
+// Other platforms only have the fstream path.
+long CloneEngine::transfer (int, int, off_t, size_t) { errno = ENOSYS; return -1; }
+long CopyFileRangeEngine::transfer (int, int, off_t, size_t) { errno = ENOSYS; return -1; }
+long SendfileEngine::transfer (int, int, off_t, size_t) { errno = ENOSYS; return -1; }
+SpliceEngine::SpliceEngine (): _pipeSize(0) { _pipe[0] = _pipe[1] = -1; }
+SpliceEngine::~SpliceEngine () {}
+long SpliceEngine::transfer (int, int, off_t, size_t) { errno = ENOSYS; return -1; }
+struct UringEngine::Ring {};
+UringEngine::UringEngine (CopyEngineOptions const& options): _options(options) {}
+UringEngine::~UringEngine () {}
+long UringEngine::transfer (int, int, off_t, size_t) { errno = ENOSYS; return -1; }
+long UringEngine::pipeline (int, int, off_t, size_t) { errno = ENOSYS; return -1; }
+
+//------------------------------------------------------------------------------
+bool makeCopyEngines (string const& name, CopyEngineList& engines, bool, CopyEngineOptions const&) {
+   engines.clear();
+   return name == "auto" || name == "stream";
+}
+
+#endif
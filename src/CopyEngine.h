@@ -0,0 +1,136 @@
+//==============================================================================
+// CopyEngine.h
+// created October 16, 2026
+//==============================================================================
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+
+//==============================================================================
+// CopyEngine
+//==============================================================================
+
+//------------------------------------------------------------------------------
+/*
+ * Note: A CopyEngine moves bytes between two open files without routing them
+ * through one of our own buffers. FileCopier holds a list of engines and tries
+ * them in order: if an engine reports that the kernel or filesystem can't do
+ * what it asks (see CopyEngine::unsupported) the next one is tried, and if none
+ * of them work FileCopier falls back on its fstream loop.
+ *
+ * Engines always copy a range to the same offset in the destination. This lets
+ * FileCopier report progress between calls exactly as it does when counting
+ * buffers, and it leaves room for engines that skip holes or split a file.
+ *
+ * Only UringEngine goes through user space, and it keeps a whole chunk's worth
+ * of reads and writes in flight at once rather than one buffer at a time. It
+ * isn't part of "auto": copy_file_range beats it wherever both work.
+ */
+
+//------------------------------------------------------------------------------
+// Settings for engines that have their own buffers.
+struct CopyEngineOptions {
+   size_t buffer_bytes;     // size of each buffer
+   unsigned queue_depth;    // buffers (and so reads or writes) in flight at once
+   bool direct;             // use O_DIRECT for files of at least direct_bytes
+   off_t direct_bytes;
+
+   CopyEngineOptions (): buffer_bytes(1 << 20), queue_depth(8), direct(false), direct_bytes(1 << 26) {}
+};
+
+//------------------------------------------------------------------------------
+class CopyEngine {
+public:
+   virtual ~CopyEngine () {}
+   virtual char const* name () const = 0;
+
+   // Copies at most len bytes starting at off. Returns the number of bytes
+   // copied (0 at end of file), or -1 with errno set.
+   virtual long transfer (int src, int dst, off_t off, size_t len) = 0;
+
+   // True if the bytes this engine transfers share storage with the source
+   // instead of being written again.
+   virtual bool clones () const { return false; }
+
+   // True if errno value err means "try another engine" rather than "I/O failed".
+   static bool unsupported (int err);
+};
+
+typedef std::vector<std::unique_ptr<CopyEngine>> CopyEngineList;
+
+//------------------------------------------------------------------------------
+// FICLONERANGE ioctl: on copy-on-write filesystems (btrfs, XFS with reflink) the
+// destination shares the source's extents, so nothing is read or written. Fails
+// with EXDEV across volumes and EOPNOTSUPP elsewhere.
+class CloneEngine : public CopyEngine {
+public:
+   char const* name () const { return "clone"; }
+   long transfer (int src, int dst, off_t off, size_t len);
+   bool clones () const { return true; }
+};
+
+//------------------------------------------------------------------------------
+// copy_file_range(2): the kernel copies (or lets the filesystem offload) the
+// range without it ever reaching user space.
+class CopyFileRangeEngine : public CopyEngine {
+public:
+   char const* name () const { return "copy_file_range"; }
+   long transfer (int src, int dst, off_t off, size_t len);
+};
+
+//------------------------------------------------------------------------------
+// sendfile(2): a page cache to file copy. Writes at dst's file offset, which we
+// move to off before each call.
+class SendfileEngine : public CopyEngine {
+public:
+   char const* name () const { return "sendfile"; }
+   long transfer (int src, int dst, off_t off, size_t len);
+};
+
+//------------------------------------------------------------------------------
+// splice(2): moves pages from src into a pipe and from the pipe into dst.
+class SpliceEngine : public CopyEngine {
+private:
+   int _pipe[2];
+   size_t _pipeSize;
+
+public:
+   SpliceEngine ();
+   ~SpliceEngine ();
+   char const* name () const { return "splice"; }
+   long transfer (int src, int dst, off_t off, size_t len);
+};
+
+//------------------------------------------------------------------------------
+// io_uring: reads go into a pool of aligned buffers (registered with the kernel
+// when it allows), and each buffer is written out as soon as its read completes,
+// so up to queue_depth reads and writes are in flight at once. The ring is set
+// up on first use, with the raw system calls; where io_uring is missing or
+// disabled transfer fails with ENOSYS and the next engine takes over.
+class UringEngine : public CopyEngine {
+private:
+   struct Ring;
+   std::unique_ptr<Ring> _ring;
+   CopyEngineOptions _options;
+
+public:
+   UringEngine (CopyEngineOptions const& options);
+   ~UringEngine ();
+   char const* name () const { return "io_uring"; }
+   long transfer (int src, int dst, off_t off, size_t len);
+
+private:
+   long pipeline (int src, int dst, off_t off, size_t len);
+};
+
+//------------------------------------------------------------------------------
+// Builds the engines selected by name: "auto" gives every engine this platform
+// has in order of preference, "stream" gives none (so FileCopier only uses
+// fstreams), and any other engine name gives just that engine ("io_uring" has
+// to be asked for by name). If clone is set a CloneEngine goes in front of them.
+// Returns false if the name isn't recognized.
+bool makeCopyEngines (std::string const& name, CopyEngineList& engines, bool clone = false,
+                      CopyEngineOptions const& options = CopyEngineOptions());
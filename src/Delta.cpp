@@ -0,0 +1,265 @@
+//==============================================================================
+// Delta.cpp
+// created October 16, 2026
+//==============================================================================
+
+#include "Delta.h"
+#include "Hash.h"
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+static uint64_t strongChecksum (unsigned char const* p, size_t n) {
+   Hasher h;
+   h.update(p, n);
+   return h.digest();
+}
+
+//------------------------------------------------------------------------------
+static unsigned tagOf (uint32_t weak) {
+   return (weak ^ (weak >> 16)) & 0xffff;
+}
+
+//------------------------------------------------------------------------------
+// Reads up to n bytes at off, stopping early only at the end of the file.
+static long readFully (int fd, char* p, size_t n, off_t off) {
+   size_t got = 0;
+   while (got < n) {
+      long r = pread(fd, p + got, n - got, off + got);
+      if (r < 0) {
+         if (errno == EINTR) continue;
+         return -1;
+      }
+      if (r == 0) break;
+      got += r;
+   }
+   return got;
+}
+
+//------------------------------------------------------------------------------
+static bool writeFully (int fd, char const* p, size_t n, off_t off) {
+   while (n) {
+      long r = pwrite(fd, p, n, off);
+      if (r < 0) {
+         if (errno == EINTR) continue;
+         return false;
+      }
+      p += r;
+      off += r;
+      n -= r;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+static bool copyRange (int in, off_t inOff, int out, off_t outOff, off_t len, vector<char>& buf) {
+   while (len > 0) {
+      long n = readFully(in, buf.data(), min<off_t>(buf.size(), len), inOff);
+      if (n < 0) return false;
+      if (n == 0) {
+         errno = EIO;  // the file shrank beneath us
+         return false;
+      }
+      if (!writeFully(out, buf.data(), n, outOff)) return false;
+      inOff += n;
+      outOff += n;
+      len -= n;
+   }
+   return true;
+}
+
+
+//==============================================================================
+// Checksums
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Taking the bytes 16 at a time, each group adds 16 * a plus a fixed weighting
+// of its bytes to b. The inner loop has a constant trip count and no carried
+// dependence, so it vectorizes. The sums wrap mod 2^32, which is harmless since
+// we only keep 16 bits of each.
+uint32_t blockChecksum (unsigned char const* p, size_t n) {
+   uint32_t a = 0;
+   uint32_t b = 0;
+   size_t i = 0;
+   for (; i + 16 <= n; i += 16) {
+      uint32_t sa = 0;
+      uint32_t sb = 0;
+      for (unsigned k=0; k<16; ++k) {
+         sa += p[i + k];
+         sb += (16 - k) * uint32_t(p[i + k]);
+      }
+      b += 16 * a + sb;
+      a += sa;
+   }
+   for (; i<n; ++i) {
+      a += p[i];
+      b += a;
+   }
+   return (a & 0xffff) | (b << 16);
+}
+
+//------------------------------------------------------------------------------
+void RollingChecksum::reset (unsigned char const* p, size_t n) {
+   uint32_t c = blockChecksum(p, n);
+   _a = c & 0xffff;
+   _b = c >> 16;
+   _n = n;
+}
+
+
+//==============================================================================
+// BlockSignatures
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// About the square root of the size (as rsync does), as a power of two.
+size_t BlockSignatures::blockBytesFor (off_t size) {
+   size_t b = 1 << 12;
+   while (b < (1 << 17) && off_t(b) * off_t(b) < size) b <<= 1;
+   return b;
+}
+
+//------------------------------------------------------------------------------
+bool BlockSignatures::compute (int fd, off_t size, vector<char>& buf) {
+   block_bytes = blockBytesFor(size);
+   size_t chunk = max<size_t>(block_bytes, (1 << 22) / block_bytes * block_bytes);
+   if (buf.size() < chunk) buf.resize(chunk);
+   _blocks.clear();
+   _index.clear();
+   _tags.assign(1 << 16, 0);
+
+   // only whole blocks get signatures; a short last block is always sent whole
+   for (off_t off = 0; off + off_t(block_bytes) <= size; off += chunk) {
+      long n = readFully(fd, buf.data(), min<off_t>(chunk, size - off), off);
+      if (n < 0) return false;
+      unsigned char const* p = reinterpret_cast<unsigned char const*>(buf.data());
+      for (long i = 0; i + long(block_bytes) <= n; i += block_bytes) {
+         Block b = { blockChecksum(p + i, block_bytes), strongChecksum(p + i, block_bytes) };
+         _index.insert(make_pair(b.weak, uint32_t(_blocks.size())));
+         _tags[tagOf(b.weak)] = 1;
+         _blocks.push_back(b);
+      }
+      if (n < long(chunk)) break;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// The strong checksum reads the whole block, so it's left until some block's
+// weak checksum matches exactly; on a big file most tags are set, and hashing
+// at every tag hit would make a scan cost a block's worth per byte.
+long BlockSignatures::find (uint32_t weak, unsigned char const* p, size_t n, long expected) const {
+   if (!_tags[tagOf(weak)]) return -1;
+
+   bool hashed = false;
+   uint64_t strong = 0;
+   auto matches = [&] (Block const& b) {
+      if (b.weak != weak) return false;
+      if (!hashed) {
+         strong = strongChecksum(p, n);
+         hashed = true;
+      }
+      return b.strong == strong;
+   };
+   if (expected >= 0 && size_t(expected) < _blocks.size() && matches(_blocks[expected])) return expected;
+   auto range = _index.equal_range(weak);
+   for (auto itr = range.first; itr != range.second; ++itr) {
+      if (matches(_blocks[itr->second])) return itr->second;
+   }
+   return -1;
+}
+
+
+//==============================================================================
+// Deltas
+//==============================================================================
+
+//------------------------------------------------------------------------------
+bool computeDelta (int src, off_t size, BlockSignatures const& sig, vector<char>& buf,
+                   vector<DeltaOp>& ops, function<void (off_t)> const& progress) {
+   size_t bs = sig.block_bytes;
+   if (buf.size() < max<size_t>(1 << 22, 4 * bs)) buf.resize(max<size_t>(1 << 22, 4 * bs));
+
+   // buf holds src[bufStart, bufEnd), and the window is src[pos, pos + bs)
+   off_t bufStart = 0;
+   off_t bufEnd = 0;
+   off_t pos = 0;
+   off_t literal = 0;    // start of the literal data not yet in ops
+   long expected = 0;
+   bool rolling = false;
+   RollingChecksum rc;
+
+   while (true) {
+      // slide the buffer along when the window reaches its end
+      if (pos + off_t(bs) > bufEnd && bufEnd < size) {
+         size_t keep = bufEnd - pos;
+         memmove(buf.data(), buf.data() + (pos - bufStart), keep);
+         bufStart = pos;
+         long n = readFully(src, buf.data() + keep, min<off_t>(buf.size() - keep, size - bufStart - keep), pos + keep);
+         if (n < 0) return false;
+         if (n == 0) size = bufEnd;  // the file shrank beneath us
+         bufEnd += n;
+         progress(n);
+      }
+      if (pos + off_t(bs) > bufEnd) break;
+
+      unsigned char const* p = reinterpret_cast<unsigned char const*>(buf.data()) + (pos - bufStart);
+      if (!rolling) {
+         rc.reset(p, bs);
+         rolling = true;
+      }
+      long j = sig.find(rc.value(), p, bs, expected);
+      if (j >= 0) {
+         if (literal < pos) ops.push_back(DeltaOp{ literal, pos - literal, -1 });
+         DeltaOp* last = ops.size() ? &ops.back() : 0;
+         if (last && last->block >= 0 && last->block + long(last->length / bs) == j) {
+            last->length += bs;
+         } else {
+            ops.push_back(DeltaOp{ pos, off_t(bs), j });
+         }
+         pos += bs;
+         literal = pos;
+         expected = j + 1;
+         rolling = false;
+      } else {
+         if (pos + off_t(bs) < bufEnd) {
+            rc.roll(p[0], p[bs]);
+         } else {
+            rolling = false;
+         }
+         ++pos;
+      }
+   }
+
+   if (literal < bufEnd) ops.push_back(DeltaOp{ literal, bufEnd - literal, -1 });
+   return true;
+}
+
+//------------------------------------------------------------------------------
+bool deltaInPlace (vector<DeltaOp> const& ops, size_t block_bytes) {
+   for (DeltaOp const& op : ops) {
+      if (op.block >= 0 && op.block * off_t(block_bytes) != op.offset) return false;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+bool applyDelta (int src, int old, int dst, vector<DeltaOp> const& ops, size_t block_bytes,
+                 vector<char>& buf) {
+   off_t end = 0;
+   for (DeltaOp const& op : ops) {
+      if (op.block < 0) {
+         if (!copyRange(src, op.offset, dst, op.offset, op.length, buf)) return false;
+      } else if (dst != old) {
+         if (!copyRange(old, op.block * off_t(block_bytes), dst, op.offset, op.length, buf)) return false;
+      }
+      end = op.offset + op.length;
+   }
+   return ftruncate(dst, end) == 0;
+}
@@ -0,0 +1,109 @@
+//==============================================================================
+// Delta.h
+// created October 16, 2026
+//==============================================================================
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+//------------------------------------------------------------------------------
+/*
+ * Note: This is the rsync algorithm, minus the network. The old copy of a file
+ * (in B) is cut into blocks, and each block gets a weak checksum that can be
+ * rolled along a byte at a time and a strong one (XXH64) to confirm matches.
+ * The new copy (in A) is then scanned with a rolling window: wherever the window
+ * matches a block of the old copy we note a copy of that block, and everything
+ * in between is literal data.
+ *
+ * If every matched block is still where it was (the usual case for disk images
+ * and databases, which are rewritten in place) the old copy can be patched by
+ * writing just the literal data; otherwise the new file has to be put together
+ * from old blocks and literals (see applyDelta).
+ *
+ * blockChecksum is the per block kernel: it sums fixed width groups of bytes
+ * with constant weights, which the compiler turns into vector code.
+ */
+
+//------------------------------------------------------------------------------
+// Weak checksum of p[0, n): a is the sum of the bytes and b the sum of the
+// running values of a, each mod 2^16, packed as a | b << 16.
+uint32_t blockChecksum (unsigned char const* p, size_t n);
+
+//------------------------------------------------------------------------------
+// A weak checksum over a window of n bytes that can be moved forward one byte
+// at a time.
+class RollingChecksum {
+private:
+   uint32_t _a;
+   uint32_t _b;
+   uint32_t _n;
+
+public:
+   RollingChecksum (): _a(0), _b(0), _n(0) {}
+   void reset (unsigned char const* p, size_t n);
+   void roll (unsigned char out, unsigned char in) {
+      _a += in - out;
+      _b += _a - _n * out;
+   }
+   uint32_t value () const { return (_a & 0xffff) | (_b << 16); }
+};
+
+//------------------------------------------------------------------------------
+// The weak and strong checksums of each block of a file.
+class BlockSignatures {
+private:
+   struct Block {
+      uint32_t weak;
+      uint64_t strong;
+   };
+   std::vector<Block> _blocks;
+   std::unordered_multimap<uint32_t, uint32_t> _index;  // weak checksum -> block
+   std::vector<char> _tags;                             // is any block's weak checksum this, mod 2^16?
+
+public:
+   size_t block_bytes;
+
+public:
+   BlockSignatures (): block_bytes(0) {}
+
+   // Reads fd (of size bytes) through buf. Returns false on a read error.
+   bool compute (int fd, off_t size, std::vector<char>& buf);
+
+   size_t blocks () const { return _blocks.size(); }
+   // The block of n bytes at p matches, with this weak checksum, or -1. The
+   // block expected (the one after the last match) is tried first.
+   long find (uint32_t weak, unsigned char const* p, size_t n, long expected) const;
+
+   static size_t blockBytesFor (off_t size);
+};
+
+//------------------------------------------------------------------------------
+// One piece of the new file: length bytes at offset, from block `block` of the
+// old file or, if block is negative, from the same offset in the new file.
+struct DeltaOp {
+   off_t offset;
+   off_t length;
+   long block;
+};
+
+//------------------------------------------------------------------------------
+// Scans src (of size bytes) against sig, appending the pieces of src to ops.
+// progress is called with the number of bytes scanned as the scan goes. Returns
+// false on a read error.
+bool computeDelta (int src, off_t size, BlockSignatures const& sig, std::vector<char>& buf,
+                   std::vector<DeltaOp>& ops, std::function<void (off_t)> const& progress);
+
+//------------------------------------------------------------------------------
+// True if every block in ops is copied to where it already is, so the old file
+// can be patched in place.
+bool deltaInPlace (std::vector<DeltaOp> const& ops, size_t block_bytes);
+
+//------------------------------------------------------------------------------
+// Writes the new file to dst, from literals in src and blocks of old. If dst is
+// old (only possible if deltaInPlace) only the literals are written. Returns
+// false, with errno set, on an I/O error.
+bool applyDelta (int src, int old, int dst, std::vector<DeltaOp> const& ops, size_t block_bytes,
+                 std::vector<char>& buf);
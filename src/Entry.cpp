@@ -0,0 +1,303 @@
+//==============================================================================
+// Entry.cpp
+// created October 16, 2026
+//==============================================================================
+
+#include "FileSize.h"
+#include "Entry.h"
+#include "Metrics.h"
+#include "Throttle.h"
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+using namespace std;
+
+
+//------------------------------------------------------------------------------
+void Entry::set (struct stat const& st) {
+   if (S_ISREG(st.st_mode)) {
+      type = File;
+   } else if (S_ISDIR(st.st_mode)) {
+      type = Dir;
+   } else if (S_ISLNK(st.st_mode)) {
+      type = Link;
+   } else {
+      type = Other;
+   }
+   size = type == File ? FileSize::sizeType(st.st_size) : 0;
+   mtime = st.st_mtim;
+   dev = st.st_dev;
+   ino = st.st_ino;
+   nlink = st.st_nlink;
+}
+
+
+//==============================================================================
+// Paths
+//==============================================================================
+
+static const size_t blockBytes = 1 << 20;
+
+//------------------------------------------------------------------------------
+PathNode const* PathArena::make (PathNode const* parent, char const* name, size_t length) {
+   size_t bytes = (sizeof(PathNode) + length + alignof(PathNode) - 1) & ~(alignof(PathNode) - 1);
+   if (bytes > _left) {
+      size_t block = max(bytes, blockBytes);
+      _blocks.emplace_back(new char[block]);
+      _next = _blocks.back().get();
+      _left = block;
+   }
+   PathNode* node = reinterpret_cast<PathNode*>(_next);
+   node->parent = parent;
+   node->length = length;
+   memcpy(node + 1, name, length);
+   _next += bytes;
+   _left -= bytes;
+   return node;
+}
+
+//------------------------------------------------------------------------------
+shared_ptr<PathNode const> PathNode::make (shared_ptr<PathNode const> const& parent, char const* name, size_t length) {
+   char* block = new char[sizeof(PathNode) + length];
+   PathNode* node = reinterpret_cast<PathNode*>(block);
+   node->parent = parent.get();
+   node->length = length;
+   memcpy(node + 1, name, length);
+   shared_ptr<PathNode const> keep = parent;
+   return shared_ptr<PathNode const>(node, [keep] (PathNode const* n) {
+      delete[] reinterpret_cast<char const*>(n);
+   });
+}
+
+//------------------------------------------------------------------------------
+// The rest of other's current block is given up, which wastes a little but
+// leaves other ready to carry on with a new one.
+void PathArena::append (PathArena& other) {
+   for (auto& b : other._blocks) {
+      _blocks.push_back(std::move(b));
+   }
+   other._blocks.clear();
+   other._next = 0;
+   other._left = 0;
+}
+
+//------------------------------------------------------------------------------
+void PathArena::clear () {
+   if (_blocks.size() > 1) _blocks.resize(1);
+   _next = _blocks.size() ? _blocks[0].get() : 0;
+   _left = _blocks.size() ? blockBytes : 0;
+}
+
+//------------------------------------------------------------------------------
+string RelPath::string () const {
+   size_t length = 0;
+   for (PathNode const* n = _node; n; n = n->parent) {
+      length += n->length + 1;
+   }
+   std::string s(length ? length - 1 : 0, '/');
+   size_t end = s.size();
+   for (PathNode const* n = _node; n; n = n->parent) {
+      end -= n->length;
+      memcpy(&s[end], n->name(), n->length);
+      if (end) --end;
+   }
+   return s;
+}
+
+//------------------------------------------------------------------------------
+int RelPath::compareName (RelPath const& p) const {
+   uint32_t n1 = _node ? _node->length : 0;
+   uint32_t n2 = p._node ? p._node->length : 0;
+   int order = memcmp(_node ? _node->name() : "", p._node ? p._node->name() : "", min(n1, n2));
+   return order ? order : int(n1) - int(n2);
+}
+
+//------------------------------------------------------------------------------
+bool RelPath::operator== (RelPath const& p) const {
+   PathNode const* a = _node;
+   PathNode const* b = p._node;
+   while (a != b) {
+      if (!a || !b || a->length != b->length || memcmp(a->name(), b->name(), a->length)) return false;
+      a = a->parent;
+      b = b->parent;
+   }
+   return true;
+}
+
+//------------------------------------------------------------------------------
+// Printed just as a bfs::path would be.
+ostream& operator<< (ostream& os, RelPath const& p) {
+   return os << bfs::path(p.string());
+}
+
+
+//==============================================================================
+// Entries
+//==============================================================================
+
+//------------------------------------------------------------------------------
+OpenDir::OpenDir (bfs::path const& full): _name(full), _fd(-1), _err(0), _opened(false) {}
+
+//------------------------------------------------------------------------------
+OpenDir::OpenDir (shared_ptr<OpenDir> const& parent, bfs::path const& name)
+: _parent(parent), _name(name), _fd(-1), _err(0), _opened(false) {}
+
+//------------------------------------------------------------------------------
+OpenDir::~OpenDir () {
+   if (_fd >= 0) close(_fd);
+}
+
+//------------------------------------------------------------------------------
+int OpenDir::fd () {
+   lock_guard<mutex> lock(_m);
+   if (!_opened) {
+      // a directory found by a scan is never reached through a link, even one
+      // that's replaced it since
+      int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+      int parent = _parent ? _parent->fd() : -1;
+      _fd = parent >= 0 ? openat(parent, _name.c_str(), flags | O_NOFOLLOW) : ::open(_name.c_str(), flags);
+      metrics.count(Call::Open);
+      _err = _fd < 0 ? errno : 0;
+      _opened = true;
+      _parent.reset();
+   }
+   if (_fd < 0) errno = _err;
+   return _fd;
+}
+
+//------------------------------------------------------------------------------
+// Reads the open directory stream d (which is closed when done).
+static void scanStream (DIR* d, PathNode const* parent, bool ignoreHidden, PathArena& names,
+                        vector<Entry>& out, Entry* self) {
+   int fd = dirfd(d);
+
+   struct dirent* de;
+   struct stat st;
+   Entry e;
+   if (self && fstat(fd, &st) == 0) self->set(st);
+   while ((de = readdir(d))) {
+      char const* name = de->d_name;
+      if (name[0] == '.' && (ignoreHidden || !name[1] || (name[1] == '.' && !name[2]))) continue;
+      if (de->d_type != DT_UNKNOWN && de->d_type != DT_REG && de->d_type != DT_DIR && de->d_type != DT_LNK) continue;
+
+      // one stat per entry; if it vanished since readdir we never saw it
+      throttle.files.take(1);
+      metrics.count(Call::Stat);
+      if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+      if (S_ISLNK(st.st_mode)) {
+         // a link to a file stands for the file; any other stays a link
+         struct stat target;
+         metrics.count(Call::Stat);
+         if (fstatat(fd, name, &target, 0) == 0 && S_ISREG(target.st_mode)) st = target;
+      }
+      e.set(st);
+      if (e.type == Entry::Other) continue;
+      e.path = RelPath(names.make(parent, name, strlen(name)));
+      out.push_back(e);
+   }
+   closedir(d);
+}
+
+//------------------------------------------------------------------------------
+void scanDirectory (OpenDir& dir, bfs::path const& display, RelPath const& parent, bool ignoreHidden,
+                    PathArena& names, vector<Entry>& out, Entry* self) {
+   TraceSpan span("scan", display.c_str());
+   Metrics::Clock::time_point start = Metrics::Clock::now();
+   size_t before = out.size();
+
+   // the stream takes its own fd, leaving dir's open for whoever comes next
+   int fd = dir.fd();
+   if (fd >= 0) fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+   DIR* d = fd >= 0 ? fdopendir(fd) : 0;
+   if (!d) {
+      int err = errno;
+      if (fd >= 0) close(fd);
+      throw bfs::filesystem_error("opendir", display, boost::system::error_code(err, boost::system::system_category()));
+   }
+   rewinddir(d);
+   scanStream(d, parent.node(), ignoreHidden, names, out, self);
+   metrics.scanned(Metrics::Clock::now() - start, out.size() - before);
+}
+
+//------------------------------------------------------------------------------
+// The first 8 bytes of a name, big endian so that keys compare as names do
+// (short names are padded with zeros, and names never contain a zero).
+static uint64_t prefixOf (PathNode const* n) {
+   unsigned char const* p = reinterpret_cast<unsigned char const*>(n->name());
+   unsigned length = min<uint32_t>(n->length, 8);
+   uint64_t key = 0;
+   for (unsigned i=0; i<length; ++i) {
+      key |= uint64_t(p[i]) << (56 - 8 * i);
+   }
+   return key;
+}
+
+//------------------------------------------------------------------------------
+// Small directories are simply sorted. Big ones are sorted as 16 byte keys (the
+// first 8 bytes of the name and where the entry is) with a radix sort, a byte
+// per pass, which reads and writes the keys in order and never looks at a name
+// twice; passes over bytes that every key shares are skipped. Only names that
+// share their first 8 bytes are then compared in full. Last, the entries are
+// moved into place once each.
+void sortByName (vector<Entry>& entries) {
+   auto byName = [] (Entry const& a, Entry const& b) { return a.path.compareName(b.path) < 0; };
+   size_t n = entries.size();
+   if (n < 256) {
+      sort(entries.begin(), entries.end(), byName);
+      return;
+   }
+
+   struct Key {
+      uint64_t prefix;
+      size_t index;
+   };
+   vector<Key> keys(n);
+   vector<Key> temp(n);
+   for (size_t i=0; i<n; ++i) {
+      keys[i] = Key{ prefixOf(entries[i].path.node()), i };
+   }
+
+   for (unsigned shift=0; shift<64; shift+=8) {
+      size_t count[256] = {};
+      for (Key const& k : keys) {
+         ++count[(k.prefix >> shift) & 0xff];
+      }
+      if (count[(keys[0].prefix >> shift) & 0xff] == n) continue;
+      size_t sum = 0;
+      for (unsigned b=0; b<256; ++b) {
+         size_t c = count[b];
+         count[b] = sum;
+         sum += c;
+      }
+      for (Key const& k : keys) {
+         temp[count[(k.prefix >> shift) & 0xff]++] = k;
+      }
+      keys.swap(temp);
+   }
+
+   for (size_t i=0; i<n; ) {
+      size_t j = i + 1;
+      while (j < n && keys[j].prefix == keys[i].prefix) ++j;
+      if (j - i > 1) {
+         sort(keys.begin() + i, keys.begin() + j, [&] (Key const& a, Key const& b) {
+            return entries[a.index].path.compareName(entries[b.index].path) < 0;
+         });
+      }
+      i = j;
+   }
+
+   vector<Entry> sorted;
+   sorted.reserve(n);
+   for (Key const& k : keys) {
+      sorted.push_back(entries[k.index]);
+   }
+   entries.swap(sorted);
+}
@@ -0,0 +1,165 @@
+//==============================================================================
+// Entry.h
+// created October 16, 2026
+// (include after FileSize.h)
+//==============================================================================
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+
+namespace bfs = boost::filesystem;
+
+
+//------------------------------------------------------------------------------
+/*
+ * Note: An Entry is everything we need to know about a file or directory, and
+ * it's filled in by a single stat when the directory containing it is scanned.
+ * The type comes from readdir when the filesystem provides it, which lets us
+ * skip things we don't back up (sockets, devices, ...) without a stat at all.
+ * A symbolic link to a file is treated as that file, but any other link (to a
+ * directory, or to nothing) is a Link: a leaf that's never followed, so a scan
+ * never leaves the trees being compared or goes round a loop. Links are left
+ * alone, except that a directory unique to B goes with the links in it (the
+ * links themselves, not what they point to).
+ *
+ * Everything downstream (FileVector, DirVector, the issue lists) keeps Entries
+ * rather than paths, so nothing needs to go back to the filesystem to learn a
+ * size or a type that was known when the directory was read.
+ *
+ * Paths are kept as a tree of names (see PathNode): each entry holds only its
+ * own name and a pointer to its directory's node, so the relative path leading
+ * to it isn't repeated for every file, and a path is only spelled out in full
+ * when it's printed or handed to the filesystem. The nodes and names are carved
+ * out of a PathArena, a few large blocks instead of a heap string per entry.
+ * Scans are sorted by name with sortByName, byte by byte.
+ *
+ * When we do go back, it's through an OpenDir where we can: a directory held
+ * open so that the things in it are reached by name alone (openat, fstatat,
+ * mkdirat, unlinkat) instead of making the kernel walk the whole path from the
+ * top again. Full paths are still built for messages and for the odd fallback.
+ */
+
+//------------------------------------------------------------------------------
+// One name in a tree of paths: the name itself (length bytes, not terminated)
+// follows the node in memory, and parent is the directory it's in, or null if
+// it's in the directories being compared.
+struct PathNode {
+   PathNode const* parent;
+   uint32_t length;
+
+   char const* name () const { return reinterpret_cast<char const*>(this + 1); }
+   // A node of its own rather than an arena's, freed when the last pointer to it
+   // goes, and keeping its parent until then.
+   static std::shared_ptr<PathNode const> make (std::shared_ptr<PathNode const> const& parent,
+                                                char const* name, size_t length);
+};
+
+//------------------------------------------------------------------------------
+// Where PathNodes live. Nodes are never moved or freed before the arena is, and
+// append hands one arena's blocks over to another, so a node stays valid for
+// as long as whichever arena ends up holding it.
+class PathArena {
+private:
+   std::vector<std::unique_ptr<char[]>> _blocks;
+   char* _next;
+   size_t _left;
+
+public:
+   PathArena (): _next(0), _left(0) {}
+   PathNode const* make (PathNode const* parent, char const* name, size_t length);
+   void append (PathArena& other);
+   // Forgets every node, keeping one block to make new ones in.
+   void clear ();
+};
+
+//------------------------------------------------------------------------------
+// A path relative to the directories being compared, as a PathNode (null for
+// the top). It converts to a bfs::path, which is built when asked for.
+class RelPath {
+private:
+   PathNode const* _node;
+
+public:
+   RelPath (): _node(0) {}
+   explicit RelPath (PathNode const* node): _node(node) {}
+
+   PathNode const* node () const { return _node; }
+   bool empty () const { return !_node; }
+   RelPath parent_path () const { return RelPath(_node ? _node->parent : 0); }
+   bfs::path filename () const { return _node ? bfs::path(_node->name(), _node->name() + _node->length) : bfs::path(); }
+   std::string string () const;
+   operator bfs::path () const { return bfs::path(string()); }
+
+   // Orders by the last name only, byte by byte.
+   int compareName (RelPath const& p) const;
+   bool operator== (RelPath const& p) const;
+   bool operator!= (RelPath const& p) const { return !(*this == p); }
+};
+std::ostream& operator<< (std::ostream& os, RelPath const& p);
+
+//------------------------------------------------------------------------------
+struct Entry {
+   enum Type : unsigned char { Other, File, Dir, Link };
+
+   RelPath path;            // relative to the directories being compared
+   Type type;
+   FileSize size;
+   struct timespec mtime;
+   dev_t dev;
+   ino_t ino;
+   nlink_t nlink;
+
+   Entry (): type(Other), size(0), dev(0), ino(0), nlink(0) { mtime.tv_sec = mtime.tv_nsec = 0; }
+
+   bool isFile () const { return type == File; }
+   bool isDir  () const { return type == Dir; }
+   bool isLink () const { return type == Link; }
+   char const* kind () const { return type == File ? "file" : type == Dir ? "directory" : "link"; }
+   void set (struct stat const& st);
+};
+
+// The same path on both sides, as found in directory A (first) and B (second).
+typedef std::pair<Entry, Entry> EntryPair;
+
+//------------------------------------------------------------------------------
+// A directory, opened by whoever first asks for its fd and closed when the last
+// holder lets go of it. One made from a parent and a name is opened relative to
+// the parent, which is kept (open) only until then, and never through a link.
+class OpenDir {
+private:
+   std::shared_ptr<OpenDir> _parent;
+   bfs::path _name;       // in _parent, or a full path if there's no parent
+   int _fd;
+   int _err;
+   bool _opened;
+   std::mutex _m;
+
+public:
+   OpenDir (bfs::path const& full);
+   OpenDir (std::shared_ptr<OpenDir> const& parent, bfs::path const& name);
+   ~OpenDir ();
+
+   // The directory's fd, or -1 with errno set if it can't be opened.
+   int fd ();
+};
+typedef std::shared_ptr<OpenDir> OpenDirPtr;
+
+//------------------------------------------------------------------------------
+// Reads the files and directories in dir into out, with each path made from
+// the entry's name in names, under parent (dir's own path). Hidden entries are
+// skipped if ignoreHidden is set. If self isn't null it is set from dir itself.
+// Throws bfs::filesystem_error (naming display) if dir can't be read.
+void scanDirectory (OpenDir& dir, bfs::path const& display, RelPath const& parent, bool ignoreHidden,
+                    PathArena& names, std::vector<Entry>& out, Entry* self = 0);
+
+//------------------------------------------------------------------------------
+// Sorts entries by the last name of their paths, byte by byte.
+void sortByName (std::vector<Entry>& entries);
@@ -0,0 +1,299 @@
+//==============================================================================
+// Hash.cpp
+// created October 16, 2026
+//==============================================================================
+
+#include "Hash.h"
+#include <cstring>
+#include <fstream>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+//==============================================================================
+// Hasher
+//==============================================================================
+
+static const uint64_t P1 = 0x9E3779B185EBCA87ull;
+static const uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t P3 = 0x165667B19E3779F9ull;
+static const uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t P5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t rotl (uint64_t x, unsigned r) { return (x << r) | (x >> (64 - r)); }
+static inline uint64_t read64 (unsigned char const* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint32_t read32 (unsigned char const* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+static inline uint64_t xxRound (uint64_t acc, uint64_t input) {
+   acc += input * P2;
+   return rotl(acc, 31) * P1;
+}
+
+static inline uint64_t mergeRound (uint64_t acc, uint64_t v) {
+   acc ^= xxRound(0, v);
+   return acc * P1 + P4;
+}
+
+//------------------------------------------------------------------------------
+void Hasher::reset (uint64_t seed) {
+   _seed = seed;
+   _v[0] = seed + P1 + P2;
+   _v[1] = seed + P2;
+   _v[2] = seed;
+   _v[3] = seed - P1;
+   _total = 0;
+   _buffered = 0;
+}
+
+//------------------------------------------------------------------------------
+void Hasher::update (void const* data, size_t len) {
+   unsigned char const* p = static_cast<unsigned char const*>(data);
+   unsigned char const* end = p + len;
+   _total += len;
+
+   // top up a partial stripe left over from last time
+   if (_buffered) {
+      size_t n = min<size_t>(32 - _buffered, len);
+      memcpy(_buf + _buffered, p, n);
+      _buffered += n;
+      p += n;
+      if (_buffered < 32) return;
+      for (unsigned i=0; i<4; ++i) {
+         _v[i] = xxRound(_v[i], read64(_buf + 8 * i));
+      }
+      _buffered = 0;
+   }
+
+   // the four lanes are independent, so these rounds overlap in the pipeline
+   uint64_t v0 = _v[0], v1 = _v[1], v2 = _v[2], v3 = _v[3];
+   while (end - p >= 32) {
+      v0 = xxRound(v0, read64(p));
+      v1 = xxRound(v1, read64(p + 8));
+      v2 = xxRound(v2, read64(p + 16));
+      v3 = xxRound(v3, read64(p + 24));
+      p += 32;
+   }
+   _v[0] = v0; _v[1] = v1; _v[2] = v2; _v[3] = v3;
+
+   memcpy(_buf, p, end - p);
+   _buffered = end - p;
+}
+
+//------------------------------------------------------------------------------
+uint64_t Hasher::digest () const {
+   uint64_t h;
+   if (_total >= 32) {
+      h = rotl(_v[0], 1) + rotl(_v[1], 7) + rotl(_v[2], 12) + rotl(_v[3], 18);
+      for (unsigned i=0; i<4; ++i) {
+         h = mergeRound(h, _v[i]);
+      }
+   } else {
+      h = _seed + P5;
+   }
+   h += _total;
+
+   unsigned char const* p = _buf;
+   unsigned char const* end = _buf + _buffered;
+   for (; end - p >= 8; p += 8) {
+      h ^= xxRound(0, read64(p));
+      h = rotl(h, 27) * P1 + P4;
+   }
+   if (end - p >= 4) {
+      h ^= uint64_t(read32(p)) * P1;
+      h = rotl(h, 23) * P2 + P3;
+      p += 4;
+   }
+   for (; p < end; ++p) {
+      h ^= *p * P5;
+      h = rotl(h, 11) * P1;
+   }
+
+   h ^= h >> 33;
+   h *= P2;
+   h ^= h >> 29;
+   h *= P3;
+   h ^= h >> 32;
+   return h;
+}
+
+//------------------------------------------------------------------------------
+uint64_t hashFile (bfs::path const& p, vector<char>& buf) {
+   int fd = ::open(p.c_str(), O_RDONLY);
+   if (fd < 0) {
+      throw bfs::filesystem_error("open", p, boost::system::error_code(errno, boost::system::system_category()));
+   }
+#ifdef POSIX_FADV_SEQUENTIAL
+   posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+   if (buf.size() < (1 << 20)) buf.resize(1 << 20);
+   Hasher h;
+   while (true) {
+      long n = ::read(fd, buf.data(), buf.size());
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         int err = errno;
+         ::close(fd);
+         throw bfs::filesystem_error("read", p, boost::system::error_code(err, boost::system::system_category()));
+      }
+      if (n == 0) break;
+      h.update(buf.data(), n);
+   }
+   ::close(fd);
+   return h.digest();
+}
+
+//------------------------------------------------------------------------------
+uint64_t hashSample (bfs::path const& p, uint64_t size, vector<char>& buf) {
+   static const uint64_t sample = 1 << 16;
+   int fd = ::open(p.c_str(), O_RDONLY);
+   if (fd < 0) {
+      throw bfs::filesystem_error("open", p, boost::system::error_code(errno, boost::system::system_category()));
+   }
+
+   if (buf.size() < sample) buf.resize(sample);
+   Hasher h;
+   h.update(&size, sizeof(size));
+   uint64_t offsets[3] = { 0, size / 2, size > sample ? size - sample : 0 };
+   for (uint64_t off : offsets) {
+      long n = pread(fd, buf.data(), sample, off);
+      if (n < 0) {
+         int err = errno;
+         ::close(fd);
+         throw bfs::filesystem_error("read", p, boost::system::error_code(err, boost::system::system_category()));
+      }
+      h.update(buf.data(), n);
+   }
+   ::close(fd);
+   return h.digest();
+}
+
+//------------------------------------------------------------------------------
+// Reads as much as it can (short of the end of the file) into p.
+static long readFull (int fd, char* p, size_t n) {
+   size_t got = 0;
+   while (got < n) {
+      long r = ::read(fd, p + got, n - got);
+      if (r < 0 && errno == EINTR) continue;
+      if (r < 0) return r;
+      if (r == 0) break;
+      got += r;
+   }
+   return got;
+}
+
+//------------------------------------------------------------------------------
+bool sameContents (bfs::path const& a, bfs::path const& b, vector<char>& buf) {
+   static const size_t half = 1 << 19;
+   bfs::path const* paths[2] = { &a, &b };
+   int fds[2] = { -1, -1 };
+   auto fail = [&] (char const* call, unsigned i) {
+      int err = errno;
+      for (int fd : fds) {
+         if (fd >= 0) ::close(fd);
+      }
+      throw bfs::filesystem_error(call, *paths[i], boost::system::error_code(err, boost::system::system_category()));
+   };
+   for (unsigned i=0; i<2; ++i) {
+      fds[i] = ::open(paths[i]->c_str(), O_RDONLY);
+      if (fds[i] < 0) fail("open", i);
+#ifdef POSIX_FADV_SEQUENTIAL
+      posix_fadvise(fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+   }
+
+   if (buf.size() < 2 * half) buf.resize(2 * half);
+   bool same = true;
+   while (same) {
+      long n[2];
+      for (unsigned i=0; i<2; ++i) {
+         n[i] = readFull(fds[i], buf.data() + i * half, half);
+         if (n[i] < 0) fail("read", i);
+      }
+      same = n[0] == n[1] && !memcmp(buf.data(), buf.data() + half, n[0]);
+      if (n[0] == 0) break;
+   }
+   ::close(fds[0]);
+   ::close(fds[1]);
+   return same;
+}
+
+
+//==============================================================================
+// HashCache
+//==============================================================================
+
+static char const magic[8] = { 'B', 'K', 'H', 'A', 'S', 'H', '1', '\0' };
+
+struct HashRecord {
+   uint64_t dev;
+   uint64_t ino;
+   uint64_t size;
+   int64_t sec;
+   int64_t nsec;
+   uint64_t hash;
+};
+
+//------------------------------------------------------------------------------
+size_t HashKeyHash::operator() (HashKey const& k) const {
+   Hasher h;
+   h.update(&k.dev, sizeof(k.dev));
+   h.update(&k.ino, sizeof(k.ino));
+   h.update(&k.size, sizeof(k.size));
+   h.update(&k.sec, sizeof(k.sec));
+   h.update(&k.nsec, sizeof(k.nsec));
+   return h.digest();
+}
+
+//------------------------------------------------------------------------------
+// A missing or unrecognizable cache is simply empty.
+void HashCache::load (bfs::path const& file) {
+   ifstream in(file.c_str(), ios_base::in | ios_base::binary);
+   char m[sizeof(magic)];
+   if (!in.read(m, sizeof(m)) || memcmp(m, magic, sizeof(magic))) return;
+
+   lock_guard<mutex> lock(_m);
+   HashRecord r;
+   while (in.read(reinterpret_cast<char*>(&r), sizeof(r))) {
+      HashKey k = { dev_t(r.dev), ino_t(r.ino), r.size, r.sec, r.nsec };
+      _hashes[k] = Value{ r.hash, false };
+   }
+}
+
+//------------------------------------------------------------------------------
+void HashCache::save (bfs::path const& file) {
+   lock_guard<mutex> lock(_m);
+   bfs::path temp = file.string() + ".tmp";
+   {
+      ofstream out(temp.c_str(), ios_base::out | ios_base::binary | ios_base::trunc);
+      out.write(magic, sizeof(magic));
+      for (auto const& h : _hashes) {
+         if (!h.second.used) continue;
+         HashRecord r = { uint64_t(h.first.dev), uint64_t(h.first.ino), h.first.size, h.first.sec, h.first.nsec, h.second.hash };
+         out.write(reinterpret_cast<char const*>(&r), sizeof(r));
+      }
+      if (!out) {
+         throw bfs::filesystem_error("write", temp, boost::system::error_code(EIO, boost::system::system_category()));
+      }
+   }
+   bfs::rename(temp, file);
+}
+
+//------------------------------------------------------------------------------
+bool HashCache::find (HashKey const& k, uint64_t& hash) {
+   lock_guard<mutex> lock(_m);
+   auto itr = _hashes.find(k);
+   if (itr == _hashes.end()) return false;
+   itr->second.used = true;
+   hash = itr->second.hash;
+   return true;
+}
+
+//------------------------------------------------------------------------------
+void HashCache::insert (HashKey const& k, uint64_t hash) {
+   lock_guard<mutex> lock(_m);
+   _hashes[k] = Value{ hash, true };
+}
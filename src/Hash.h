@@ -0,0 +1,96 @@
+//==============================================================================
+// Hash.h
+// created October 16, 2026
+//==============================================================================
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <boost/filesystem.hpp>
+
+namespace bfs = boost::filesystem;
+
+
+//------------------------------------------------------------------------------
+/*
+ * Note: Hasher is XXH64 (https://github.com/Cyan4973/xxHash), written out here
+ * so we don't pick up another dependency. It keeps four independent lanes going
+ * over each 32 byte stripe, which keeps a modern core's multipliers busy and
+ * comfortably outruns any disk we're likely to read from. It is not a
+ * cryptographic hash: it's for noticing corruption, not tampering.
+ */
+
+//------------------------------------------------------------------------------
+class Hasher {
+private:
+   uint64_t _v[4];
+   uint64_t _total;
+   unsigned char _buf[32];
+   unsigned _buffered;
+   uint64_t _seed;
+
+public:
+   Hasher (uint64_t seed = 0) { reset(seed); }
+   void reset (uint64_t seed = 0);
+   void update (void const* data, size_t len);
+   uint64_t digest () const;
+};
+
+//------------------------------------------------------------------------------
+// Hashes the contents of the file at p, reading through buf (which is resized
+// as needed). Throws bfs::filesystem_error if the file can't be read.
+uint64_t hashFile (bfs::path const& p, std::vector<char>& buf);
+
+//------------------------------------------------------------------------------
+// Hashes the size of the file at p and three 64 KiB samples of it (from its
+// start, middle, and end), so two files that differ only elsewhere will agree.
+// Throws bfs::filesystem_error if the file can't be read.
+uint64_t hashSample (bfs::path const& p, uint64_t size, std::vector<char>& buf);
+
+//------------------------------------------------------------------------------
+// Returns true if the files at a and b have the same contents, reading both
+// through buf (which is resized as needed). For when a matching hash isn't
+// proof enough. Throws bfs::filesystem_error if either can't be read.
+bool sameContents (bfs::path const& a, bfs::path const& b, std::vector<char>& buf);
+
+//------------------------------------------------------------------------------
+// What a cached hash is valid for: if any of these change, we hash again.
+struct HashKey {
+   dev_t dev;
+   ino_t ino;
+   uint64_t size;
+   int64_t sec;
+   int64_t nsec;
+
+   bool operator== (HashKey const& k) const {
+      return dev == k.dev && ino == k.ino && size == k.size && sec == k.sec && nsec == k.nsec;
+   }
+};
+
+struct HashKeyHash {
+   size_t operator() (HashKey const& k) const;
+};
+
+//------------------------------------------------------------------------------
+// File hashes from earlier runs, safe to use from several threads. Only the
+// hashes that were looked up or inserted are saved, so files that have changed
+// or disappeared drop out of the cache.
+class HashCache {
+private:
+   struct Value {
+      uint64_t hash;
+      bool used;
+   };
+   std::unordered_map<HashKey, Value, HashKeyHash> _hashes;
+   std::mutex _m;
+
+public:
+   void load (bfs::path const& file);
+   void save (bfs::path const& file);
+   bool find (HashKey const& k, uint64_t& hash);
+   void insert (HashKey const& k, uint64_t hash);
+};
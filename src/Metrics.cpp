@@ -0,0 +1,317 @@
+//==============================================================================
+// Metrics.cpp
+// created October 16, 2026
+//==============================================================================
+
+#include "Metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+
+using namespace std;
+using namespace std::chrono;
+
+Metrics metrics;
+Tracer tracer;
+
+static char const* phaseNames[] = { "other", "compare", "scan", "verify", "moves", "annotate", "copy", "update",
+                                    "delete", "stream" };
+static char const* callNames[] = { "open", "stat", "transfer", "unlink", "mkdir", "rename", "sync", "metadata" };
+
+
+//==============================================================================
+// Metrics
+//==============================================================================
+
+//------------------------------------------------------------------------------
+Metrics::Counters::Counters (): scanNanos(0), scanned(0) {
+   for (unsigned p=0; p<phases; ++p) {
+      for (unsigned c=0; c<calls; ++c) {
+         made[p][c] = 0;
+      }
+   }
+}
+
+//------------------------------------------------------------------------------
+Metrics::Metrics (): _phase(0), _since(Clock::now()), _start(_since) {
+   for (unsigned p=0; p<phases; ++p) {
+      _nanos[p] = 0;
+      _bytes[p] = 0;
+      _files[p] = 0;
+      _ran[p] = false;
+   }
+}
+
+//------------------------------------------------------------------------------
+// Each thread's counters are made the first time it counts something, and
+// outlive it, since they're only added up at the end.
+Metrics::Counters& Metrics::mine () {
+   static thread_local Counters* counters = 0;
+   if (!counters) {
+      lock_guard<mutex> lock(_m);
+      _threads.emplace_back(new Counters());
+      counters = _threads.back().get();
+   }
+   return *counters;
+}
+
+//------------------------------------------------------------------------------
+void Metrics::scanned (Clock::duration time, size_t entries) {
+   Counters& c = mine();
+   c.scanNanos.store(c.scanNanos.load(memory_order_relaxed) + duration_cast<nanoseconds>(time).count(),
+                     memory_order_relaxed);
+   c.scanned.store(c.scanned.load(memory_order_relaxed) + entries, memory_order_relaxed);
+}
+
+//------------------------------------------------------------------------------
+void Metrics::moved (uint64_t bytes, uint64_t files) {
+   _bytes[_phase] += bytes;
+   _files[_phase] += files;
+}
+
+//------------------------------------------------------------------------------
+// Charges the time since the last change of phase to the current one.
+void Metrics::charge () {
+   Clock::time_point now = Clock::now();
+   _nanos[_phase] += duration_cast<nanoseconds>(now - _since).count();
+   _since = now;
+}
+
+//------------------------------------------------------------------------------
+Phase Metrics::enter (Phase p) {
+   charge();
+   Phase previous = Phase(_phase.load());
+   _phase = (unsigned char)(p);
+   _ran[unsigned(p)] = true;
+   return previous;
+}
+
+//------------------------------------------------------------------------------
+void Metrics::leave (Phase previous) {
+   charge();
+   _phase = (unsigned char)(previous);
+}
+
+//------------------------------------------------------------------------------
+void Metrics::write (ostream& os) {
+   charge();
+   uint64_t total[phases][calls] = {};
+   uint64_t scanNanos = 0;
+   uint64_t scanned = 0;
+   {
+      lock_guard<mutex> lock(_m);
+      for (auto const& t : _threads) {
+         for (unsigned p=0; p<phases; ++p) {
+            for (unsigned c=0; c<calls; ++c) {
+               total[p][c] += t->made[p][c];
+            }
+         }
+         scanNanos += t->scanNanos;
+         scanned += t->scanned;
+      }
+   }
+   _nanos[unsigned(Phase::Scan)] = scanNanos;
+   _files[unsigned(Phase::Scan)] = scanned;
+   _ran[unsigned(Phase::Scan)] = scanned > 0;
+
+   ostringstream out;
+   out << fixed << setprecision(6);
+   out << "{\n  \"seconds\": " << duration<double>(Clock::now() - _start).count() << ",\n  \"phases\": {";
+   uint64_t all[calls] = {};
+   bool first = true;
+   for (unsigned p=0; p<phases; ++p) {
+      uint64_t n = 0;
+      for (unsigned c=0; c<calls; ++c) {
+         n += total[p][c];
+         all[c] += total[p][c];
+      }
+      if (!_ran[p] && !n) continue;
+      double seconds = _nanos[p] / 1e9;
+      out << (first ? "\n" : ",\n") << "    \"" << phaseNames[p] << "\": {\"seconds\": " << seconds
+          << ", \"bytes\": " << _bytes[p] << ", \"files\": " << _files[p]
+          << ", \"bytes_per_second\": " << (seconds > 0 ? _bytes[p] / seconds : 0.0)
+          << ", \"files_per_second\": " << (seconds > 0 ? _files[p] / seconds : 0.0) << ", \"calls\": {";
+      for (unsigned c=0; c<calls; ++c) {
+         out << (c ? ", " : "") << '"' << callNames[c] << "\": " << total[p][c];
+      }
+      out << "}}";
+      first = false;
+   }
+   out << "\n  },\n  \"calls\": {";
+   for (unsigned c=0; c<calls; ++c) {
+      out << (c ? ", " : "") << '"' << callNames[c] << "\": " << all[c];
+   }
+   out << "}\n}\n";
+   os << out.str();
+}
+
+
+//------------------------------------------------------------------------------
+char const* phaseName (Phase p) {
+   return phaseNames[unsigned(p)];
+}
+
+
+//==============================================================================
+// Tracer
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Like Metrics' counters, each thread's ring is made when it first records a
+// span, and kept until the end.
+Tracer::Ring& Tracer::mine () {
+   static thread_local Ring* ring = 0;
+   if (!ring) {
+      lock_guard<mutex> lock(_m);
+      _rings.emplace_back(new Ring(unsigned(_rings.size()) + 1));
+      ring = _rings.back().get();
+   }
+   return *ring;
+}
+
+//------------------------------------------------------------------------------
+int64_t Tracer::now () const {
+   return duration_cast<nanoseconds>(Metrics::Clock::now() - _start).count();
+}
+
+//------------------------------------------------------------------------------
+uint64_t Tracer::begin (char const* name, char const* detail) {
+   Ring& r = mine();
+   uint64_t seq = r.head.load(memory_order_relaxed);
+   Span& s = r.spans[seq % capacity];
+   s.seq = seq;
+   s.name = name;
+   s.begin = now();
+   s.end = -1;
+   size_t n = strlen(detail);
+   if (n >= detailSize) {
+      detail += n - (detailSize - 1);
+      n = detailSize - 1;
+   }
+   memcpy(s.detail, detail, n);
+   s.detail[n] = '\0';
+   r.head.store(seq + 1, memory_order_release);
+   return seq;
+}
+
+//------------------------------------------------------------------------------
+// A span that outlasted a whole ring of later ones has already been written
+// over, and is lost.
+void Tracer::end (uint64_t seq) {
+   Ring& r = mine();
+   if (r.head.load(memory_order_relaxed) - seq > capacity) return;
+   r.spans[seq % capacity].end = now();
+}
+
+//------------------------------------------------------------------------------
+static void writeJSONString (ostream& out, char const* s) {
+   out << '"';
+   for (; *s; ++s) {
+      unsigned char c = *s;
+      if (c == '"' || c == '\\') {
+         out << '\\' << c;
+      } else if (c < 0x20) {
+         char buf[8];
+         snprintf(buf, sizeof(buf), "\\u%04x", c);
+         out << buf;
+      } else {
+         out << c;
+      }
+   }
+   out << '"';
+}
+
+//------------------------------------------------------------------------------
+// Meant for the end of a run, once the threads that recorded spans are done.
+void Tracer::write (ostream& os) {
+   lock_guard<mutex> lock(_m);
+   ostringstream out;
+   out << fixed << setprecision(3);
+   out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+   uint64_t lost = 0;
+   bool first = true;
+   for (auto const& r : _rings) {
+      out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << r->tid
+          << ", \"args\": {\"name\": \"" << (r->tid == 1 ? "main" : "thread " + to_string(r->tid)) << "\"}}";
+      first = false;
+
+      uint64_t head = r->head.load(memory_order_acquire);
+      uint64_t from = head > capacity ? head - capacity : 0;
+      for (uint64_t seq=from; seq<head; ++seq) {
+         Span const& s = r->spans[seq % capacity];
+         if (s.seq != seq || s.end < 0) {
+            ++lost;
+            continue;
+         }
+         out << ",\n{\"name\": \"" << s.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << r->tid
+             << ", \"ts\": " << s.begin / 1e3 << ", \"dur\": " << (s.end - s.begin) / 1e3;
+         if (s.detail[0]) {
+            out << ", \"args\": {\"path\": ";
+            writeJSONString(out, s.detail);
+            out << '}';
+         }
+         out << '}';
+      }
+      lost += from;
+   }
+   out << "\n], \"otherData\": {\"lost_spans\": " << lost << "}}\n";
+   os << out.str();
+}
+
+
+//==============================================================================
+// Rate and Reporter
+//==============================================================================
+
+//------------------------------------------------------------------------------
+void Rate::sample (uint64_t count) {
+   Metrics::Clock::time_point now = Metrics::Clock::now();
+   double since = duration<double>(now - _last).count();
+   double total = duration<double>(now - _start).count();
+   if (since > 0) current = (count - _lastCount) / since;
+   if (total > 0) average = count / total;
+   _last = now;
+   _lastCount = count;
+}
+
+//------------------------------------------------------------------------------
+double Rate::eta (uint64_t count, uint64_t total) const {
+   if (average <= 0 || count > total) return -1;
+   return (total - count) / average;
+}
+
+//------------------------------------------------------------------------------
+Reporter::Reporter (milliseconds interval, function<void ()> report)
+: _report(report), _interval(interval), _stopped(false) {
+   if (_interval.count() <= 0) return;
+   _thread = thread([this] () {
+      unique_lock<mutex> lock(_m);
+      while (!_stop.wait_for(lock, _interval, [this] () { return _stopped; })) {
+         lock.unlock();
+         _report();
+         lock.lock();
+      }
+   });
+}
+
+//------------------------------------------------------------------------------
+void Reporter::stop () {
+   {
+      lock_guard<mutex> lock(_m);
+      _stopped = true;
+   }
+   _stop.notify_all();
+   if (_thread.joinable()) _thread.join();
+}
+
+//------------------------------------------------------------------------------
+string formatSeconds (double seconds) {
+   long s = long(seconds + 0.5);
+   ostringstream out;
+   if (s >= 3600) out << s / 3600 << ':' << setw(2) << setfill('0');
+   out << (s / 60) % 60 << ':' << setw(2) << setfill('0') << s % 60;
+   return out.str();
+}
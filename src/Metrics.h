@@ -0,0 +1,220 @@
+//==============================================================================
+// Metrics.h
+// created October 16, 2026
+//==============================================================================
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+
+//------------------------------------------------------------------------------
+/*
+ * Note: Metrics keeps the totals for a run: how long each phase took, how many
+ * of each kind of system call it made, and how many bytes and files it moved.
+ * A phase is timed by a PhaseTimer on the thread that runs it; timers nest, and
+ * each phase is only charged for the time it wasn't inside another (so copy's
+ * time doesn't include annotating); time outside any phase is Other's.
+ * Scanning happens on every comparing worker at once, so its time is the sum
+ * over workers rather than a wall time.
+ *
+ * Calls are counted on each thread in counters of its own, so counting costs a
+ * plain increment and never contends with other threads; the counters are
+ * only added up when someone asks. Each call is charged to whatever phase is
+ * running when it's made.
+ *
+ * A Reporter calls a function every so often on a thread of its own, which is
+ * how progress is printed without the copiers having to check the time. Rate
+ * turns successive samples of a counter into throughput and an ETA.
+ */
+
+//------------------------------------------------------------------------------
+enum class Phase : unsigned char { Other, Compare, Scan, Verify, Moves, Annotate, Copy, Update, Delete, Stream, Count };
+enum class Call : unsigned char { Open, Stat, Transfer, Unlink, Mkdir, Rename, Sync, Metadata, Count };
+
+//------------------------------------------------------------------------------
+class Metrics {
+public:
+   typedef std::chrono::steady_clock Clock;
+
+private:
+   static const unsigned phases = unsigned(Phase::Count);
+   static const unsigned calls = unsigned(Call::Count);
+
+   // one thread's counters; only that thread writes them
+   struct Counters {
+      std::atomic<uint64_t> made[phases][calls];  // by phase and kind
+      std::atomic<uint64_t> scanNanos;
+      std::atomic<uint64_t> scanned;
+      Counters ();
+   };
+   std::vector<std::unique_ptr<Counters>> _threads;
+   std::mutex _m;
+
+   // phase totals, kept by the thread running the phases
+   uint64_t _nanos[phases];
+   uint64_t _bytes[phases];
+   uint64_t _files[phases];
+   bool _ran[phases];
+   std::atomic<unsigned char> _phase;
+   Clock::time_point _since;
+   Clock::time_point _start;
+
+public:
+   Metrics ();
+
+   void count (Call c) {
+      std::atomic<uint64_t>& n = mine().made[_phase.load(std::memory_order_relaxed)][unsigned(c)];
+      n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+   }
+   void scanned (Clock::duration time, size_t entries);
+   // Adds to what the current phase has moved.
+   void moved (uint64_t bytes, uint64_t files);
+
+   // Makes p the current phase, returning the one it interrupts.
+   Phase enter (Phase p);
+   void leave (Phase previous);
+
+   // Writes the totals as a JSON object.
+   void write (std::ostream& os);
+
+private:
+   Counters& mine ();
+   void charge ();
+};
+
+extern Metrics metrics;
+
+//------------------------------------------------------------------------------
+/*
+ * Note: Tracer records spans (what was done, to what, on which thread, from
+ * when to when) for writing out as Chrome trace events, which Perfetto and
+ * chrome://tracing show as a timeline per thread. That shows what totals can't:
+ * a scan of one enormous directory holding everything up, say, or one slow file,
+ * or workers sitting idle between spans while they wait on each other.
+ *
+ * Each thread writes its spans to a ring of its own, so recording one takes no
+ * lock and never waits on another thread; a thread that records more than a
+ * ring holds loses its oldest spans (the trace says how many). Tracing is off
+ * unless enabled, and then a span costs a check of a flag.
+ */
+class Tracer {
+public:
+   static const size_t capacity = 1 << 15;   // spans kept per thread
+   static const size_t detailSize = 96;      // the end of a longer detail is kept
+
+private:
+   struct Span {
+      uint64_t seq;
+      int64_t begin;   // nanoseconds since start, with end -1 while unfinished
+      int64_t end;
+      char const* name;
+      char detail[detailSize];
+   };
+   struct Ring {
+      std::unique_ptr<Span[]> spans;
+      std::atomic<uint64_t> head;   // spans ever begun, so the next one's seq
+      unsigned tid;
+      explicit Ring (unsigned id): spans(new Span[capacity]), head(0), tid(id) {}
+   };
+   std::vector<std::unique_ptr<Ring>> _rings;
+   std::mutex _m;
+   std::atomic<bool> _on;
+   Metrics::Clock::time_point _start;
+
+public:
+   Tracer (): _on(false), _start(Metrics::Clock::now()) {}
+
+   void enable () { _on = true; }
+   bool on () const { return _on.load(std::memory_order_relaxed); }
+   // Starts a span on this thread, returning its seq for end.
+   uint64_t begin (char const* name, char const* detail);
+   void end (uint64_t seq);
+
+   // Writes all finished spans as a Chrome trace (JSON object format).
+   void write (std::ostream& os);
+
+private:
+   Ring& mine ();
+   int64_t now () const;
+};
+
+extern Tracer tracer;
+
+//------------------------------------------------------------------------------
+// Records a span (if tracing) for as long as it lives. name must outlive the
+// run, but detail is copied.
+class TraceSpan {
+private:
+   uint64_t _seq;
+   bool _on;
+
+public:
+   explicit TraceSpan (char const* name, char const* detail = ""): _seq(0), _on(tracer.on()) {
+      if (_on) _seq = tracer.begin(name, detail);
+   }
+   ~TraceSpan () { if (_on) tracer.end(_seq); }
+};
+
+//------------------------------------------------------------------------------
+char const* phaseName (Phase p);
+
+//------------------------------------------------------------------------------
+class PhaseTimer {
+private:
+   Phase _previous;
+   TraceSpan _span;
+
+public:
+   explicit PhaseTimer (Phase p): _previous(metrics.enter(p)), _span(phaseName(p)) {}
+   ~PhaseTimer () { metrics.leave(_previous); }
+};
+
+//------------------------------------------------------------------------------
+// Throughput of a counter: since the last sample, and since the start.
+class Rate {
+private:
+   Metrics::Clock::time_point _start;
+   Metrics::Clock::time_point _last;
+   uint64_t _lastCount;
+
+public:
+   double current;   // per second
+   double average;
+
+public:
+   Rate (): _start(Metrics::Clock::now()), _last(_start), _lastCount(0), current(0), average(0) {}
+   void sample (uint64_t count);
+   // Seconds until count reaches total at the average rate, or -1 if unknown.
+   double eta (uint64_t count, uint64_t total) const;
+};
+
+//------------------------------------------------------------------------------
+// Calls report every interval on its own thread until stopped (or destroyed).
+// An interval of zero means never.
+class Reporter {
+private:
+   std::function<void ()> _report;
+   std::chrono::milliseconds _interval;
+   bool _stopped;
+   std::mutex _m;
+   std::condition_variable _stop;
+   std::thread _thread;
+
+public:
+   Reporter (std::chrono::milliseconds interval, std::function<void ()> report);
+   ~Reporter () { stop(); }
+   void stop ();
+};
+
+//------------------------------------------------------------------------------
+// Formats seconds as h:mm:ss (or m:ss).
+std::string formatSeconds (double seconds);
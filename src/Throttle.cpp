@@ -0,0 +1,158 @@
+//==============================================================================
+// Throttle.cpp
+// created October 16, 2026
+//==============================================================================
+
+#include "Throttle.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+using namespace std;
+using namespace std::chrono;
+
+Throttle throttle;
+
+
+//==============================================================================
+// TokenBucket
+//==============================================================================
+
+//------------------------------------------------------------------------------
+void TokenBucket::setRate (double perSecond) {
+   lock_guard<mutex> lock(_m);
+   _rate = max(0.0, perSecond);
+   _burst = max(1.0, _rate / 4);
+   _tokens = _burst;
+   _last = Clock::now();
+   _limited = _rate > 0;
+}
+
+//------------------------------------------------------------------------------
+// A whole number of 4 KiB pages (unless it's all of n), so that a transfer
+// that clones ranges (FICLONERANGE wants them block aligned) still can.
+size_t TokenBucket::portion (size_t n) const {
+   static const size_t page = 1 << 12;
+   if (!limited()) return n;
+   size_t most = max(size_t(1) << 16, size_t(_burst)) / page * page;
+   return min(n, most);
+}
+
+//------------------------------------------------------------------------------
+void TokenBucket::wait (double n) {
+   double debt;
+   {
+      lock_guard<mutex> lock(_m);
+      Clock::time_point now = Clock::now();
+      _tokens = min(_burst, _tokens + duration<double>(now - _last).count() * _rate);
+      _last = now;
+      _tokens -= n;
+      debt = -_tokens;
+   }
+   if (debt > 0) {
+      TraceSpan span("throttle");
+      this_thread::sleep_for(duration<double>(debt / _rate));
+   }
+}
+
+
+//==============================================================================
+// I/O class
+//==============================================================================
+
+//------------------------------------------------------------------------------
+bool setIoClass (string const& spec) {
+#ifdef SYS_ioprio_set
+   static const int whoProcess = 1;
+   static const int classShift = 13;
+   string name = spec.substr(0, spec.find(':'));
+   int level = spec.find(':') == string::npos ? 4 : atoi(spec.c_str() + spec.find(':') + 1);
+   int cls;
+   if (name == "realtime") {
+      cls = 1;
+   } else if (name == "best-effort") {
+      cls = 2;
+   } else if (name == "idle") {
+      cls = 3;
+      level = 0;
+   } else {
+      return false;
+   }
+   if (level < 0 || level > 7) return false;
+   return syscall(SYS_ioprio_set, whoProcess, 0, (cls << classShift) | level) == 0;
+#else
+   return false;
+#endif
+}
+
+
+//==============================================================================
+// AdaptiveLimit
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Starts at one at a time, to find out what the source can take before trying
+// more.
+AdaptiveLimit::AdaptiveLimit (unsigned max, double targetMs, dev_t source)
+: _max(max ? max : 1), _limit(_max), _active(0), _target(targetMs), _on(false), _reads(0), _ticks(0), _latency(0) {
+   if (_target <= 0) return;
+   ostringstream file;
+   file << "/sys/dev/block/" << major(source) << ':' << minor(source) << "/stat";
+   _statFile = file.str();
+   if (!readStats(_reads, _ticks)) return;
+   _on = true;
+   _limit = 1;
+}
+
+//------------------------------------------------------------------------------
+// The first and fourth fields are reads completed and milliseconds spent on them.
+bool AdaptiveLimit::readStats (uint64_t& reads, uint64_t& ticks) const {
+   ifstream in(_statFile.c_str());
+   uint64_t merged, sectors;
+   return bool(in >> reads >> merged >> sectors >> ticks);
+}
+
+//------------------------------------------------------------------------------
+void AdaptiveLimit::acquire () {
+   if (!_on) return;
+   unique_lock<mutex> lock(_m);
+   _freed.wait(lock, [this] () { return _active < _limit; });
+   ++_active;
+}
+
+//------------------------------------------------------------------------------
+void AdaptiveLimit::release () {
+   if (!_on) return;
+   {
+      lock_guard<mutex> lock(_m);
+      --_active;
+   }
+   _freed.notify_one();
+}
+
+//------------------------------------------------------------------------------
+// With no reads at all since last time (everything came from the page cache,
+// say) the device is taken to have room for more.
+bool AdaptiveLimit::adjust () {
+   if (!_on) return false;
+   uint64_t reads, ticks;
+   if (!readStats(reads, ticks)) return false;
+   _latency = reads > _reads ? double(ticks - _ticks) / (reads - _reads) : 0;
+   _reads = reads;
+   _ticks = ticks;
+
+   lock_guard<mutex> lock(_m);
+   unsigned previous = _limit;
+   if (_latency > _target) {
+      _limit = max(1u, _limit / 2);
+   } else if (_limit < _max) {
+      ++_limit;
+      _freed.notify_one();
+   }
+   return _limit != previous;
+}
@@ -0,0 +1,119 @@
+//==============================================================================
+// Throttle.h
+// created October 16, 2026
+//==============================================================================
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+//------------------------------------------------------------------------------
+/*
+ * Note: these keep a backup from crowding out whatever else is using the disks
+ * it reads. The global throttle holds two token buckets: bytes, which copiers
+ * take from before each transfer, and files, which copiers take from for each
+ * file and scanners for each entry they stat (so it limits operations, not just
+ * copies). A bucket with no rate set costs a check of a flag.
+ *
+ * A bucket earns rate tokens a second, saving up to a quarter second's worth.
+ * Taking more than it has leaves it in debt, which the taker sleeps off before
+ * going on; so takers are paced in turn however much each takes, and a big
+ * take is made up for by everyone after it rather than refused.
+ *
+ * AdaptiveLimit is for copying as fast as a source can stand. Copiers hold a
+ * slot while they copy, and the limit on slots is adjusted every so often from
+ * the read latency of the source's block device (as the kernel reports it in
+ * /sys/dev/block, for every reader of the device, not just us): up by one while
+ * it's under the target, and halved when it's over (AIMD, as TCP does with its
+ * window). It needs a block device to measure, so isn't on for a source that
+ * has none (tmpfs, NFS, or btrfs, which reports a device of its own).
+ */
+
+//------------------------------------------------------------------------------
+class TokenBucket {
+private:
+   typedef std::chrono::steady_clock Clock;
+
+   std::mutex _m;
+   double _rate;     // tokens a second
+   double _burst;    // the most that can be saved up
+   double _tokens;   // negative when in debt
+   Clock::time_point _last;
+   std::atomic<bool> _limited;
+
+public:
+   TokenBucket (): _rate(0), _burst(0), _tokens(0), _limited(false) {}
+
+   // Sets the rate, or with 0 removes the limit.
+   void setRate (double perSecond);
+   bool limited () const { return _limited.load(std::memory_order_relaxed); }
+   // Takes n tokens, once they're earned.
+   void take (double n) { if (limited()) wait(n); }
+   // How much of n to take at once, so transfers are paced in small steps
+   // (a multiple of 4 KiB, short of n itself).
+   size_t portion (size_t n) const;
+
+private:
+   void wait (double n);
+};
+
+//------------------------------------------------------------------------------
+struct Throttle {
+   TokenBucket bytes;
+   TokenBucket files;
+};
+
+extern Throttle throttle;
+
+//------------------------------------------------------------------------------
+// Sets the I/O scheduling class of this process, which threads started later
+// inherit: "idle", "best-effort" or "best-effort:N", or "realtime:N" (with N a
+// level from 0, the highest, to 7). Only some schedulers (BFQ, CFQ) heed it.
+// Returns false if spec isn't one of these or the kernel won't have it.
+bool setIoClass (std::string const& spec);
+
+//------------------------------------------------------------------------------
+class AdaptiveLimit {
+private:
+   std::mutex _m;
+   std::condition_variable _freed;
+   unsigned _max;
+   unsigned _limit;
+   unsigned _active;
+   double _target;   // ms
+   bool _on;
+   std::string _statFile;
+   uint64_t _reads;  // as of the last adjustment
+   uint64_t _ticks;  // ms spent reading, likewise
+   double _latency;  // ms, from the last adjustment
+
+public:
+   // Off (so allowing max at once) with a target of 0 or no device to measure.
+   AdaptiveLimit (unsigned max, double targetMs, dev_t source);
+
+   bool on () const { return _on; }
+   void acquire ();
+   void release ();
+   // Measures the latency since last time and adjusts the limit to suit,
+   // returning true if it changed.
+   bool adjust ();
+   unsigned limit () const { return _limit; }
+   double latency () const { return _latency; }
+
+   class Slot {
+   private:
+      AdaptiveLimit& _l;
+   public:
+      explicit Slot (AdaptiveLimit& l): _l(l) { _l.acquire(); }
+      ~Slot () { _l.release(); }
+   };
+
+private:
+   bool readStats (uint64_t& reads, uint64_t& ticks) const;
+};
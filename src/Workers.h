@@ -0,0 +1,152 @@
+//==============================================================================
+// Workers.h
+// created October 16, 2026
+//==============================================================================
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+//------------------------------------------------------------------------------
+// Calls work(id) for id in [0, jobs), each on its own thread (id 0 runs on the
+// calling thread, so jobs == 1 never starts a thread). If a worker throws,
+// cancel() is called once so the others can wind down, and the first exception
+// is rethrown here after every worker has finished.
+template <typename Func, typename Cancel>
+void runWorkers (unsigned jobs, Func work, Cancel cancel) {
+   std::exception_ptr failure;
+   std::mutex m;
+   auto guarded = [&] (unsigned id) {
+      try {
+         work(id);
+      }
+      catch (...) {
+         std::lock_guard<std::mutex> lock(m);
+         if (!failure) {
+            failure = std::current_exception();
+            cancel();
+         }
+      }
+   };
+
+   std::vector<std::thread> threads;
+   for (unsigned i=1; i<jobs; ++i) {
+      threads.emplace_back(guarded, i);
+   }
+   guarded(0);
+   for (std::thread& t : threads) {
+      t.join();
+   }
+   if (failure) std::rethrow_exception(failure);
+}
+
+//------------------------------------------------------------------------------
+template <typename Func>
+void runWorkers (unsigned jobs, Func work) {
+   runWorkers(jobs, work, [] () {});
+}
+
+//------------------------------------------------------------------------------
+/*
+ * Note: WorkStealingQueues gives each of n workers its own deque. A worker pushes
+ * and pops at the back of its own deque, so it explores depth first and keeps
+ * what it just found to itself. A worker whose deque is empty steals from the
+ * front of someone else's, where the oldest (and usually biggest) pieces of work
+ * are. Each deque has its own mutex, so workers only contend when stealing.
+ * A worker that finds nothing to steal sleeps until something is pushed (or
+ * the last item is done), rather than spinning.
+ *
+ * Every item pushed must be matched by a call to done() once it has been
+ * processed (after pushing any work it spawned). pop() returns false when every
+ * deque is empty and no worker is still processing an item, or after cancel().
+ */
+
+//------------------------------------------------------------------------------
+template <typename T>
+class WorkStealingQueues {
+private:
+   struct Deque {
+      std::deque<T> items;
+      std::mutex m;
+   };
+
+   std::unique_ptr<Deque[]> _deques;
+   unsigned _n;
+   std::atomic<long> _pending;
+   std::atomic<bool> _cancelled;
+   std::mutex _idleM;
+   std::condition_variable _wake;
+   std::atomic<unsigned long> _pushes;    // changed only with _idleM held
+   unsigned _idle;                        // likewise
+
+public:
+   WorkStealingQueues (unsigned n)
+   : _deques(new Deque[n]), _n(n), _pending(0), _cancelled(false), _pushes(0), _idle(0) {}
+
+   void push (unsigned id, T const& t) {
+      ++_pending;
+      {
+         std::lock_guard<std::mutex> lock(_deques[id].m);
+         _deques[id].items.push_back(t);
+      }
+      std::lock_guard<std::mutex> lock(_idleM);
+      ++_pushes;
+      if (_idle) _wake.notify_one();
+   }
+
+   // A push made after the deques were searched changes _pushes, so it can't
+   // be missed by a worker going to sleep.
+   bool pop (unsigned id, T& t) {
+      while (!_cancelled) {
+         unsigned long seen = _pushes;
+         if (popBack(id, t)) return true;
+         for (unsigned i=1; i<_n; ++i) {
+            if (stealFront((id + i) % _n, t)) return true;
+         }
+         std::unique_lock<std::mutex> lock(_idleM);
+         ++_idle;
+         _wake.wait(lock, [&] () { return _cancelled || _pending == 0 || _pushes != seen; });
+         --_idle;
+         if (_pending == 0) return false;
+      }
+      return false;
+   }
+
+   void done () {
+      if (--_pending == 0) wakeAll();
+   }
+
+   void cancel () {
+      _cancelled = true;
+      wakeAll();
+   }
+
+private:
+   void wakeAll () {
+      std::lock_guard<std::mutex> lock(_idleM);
+      _wake.notify_all();
+   }
+
+
+   bool popBack (unsigned id, T& t) {
+      std::lock_guard<std::mutex> lock(_deques[id].m);
+      if (_deques[id].items.empty()) return false;
+      t = std::move(_deques[id].items.back());
+      _deques[id].items.pop_back();
+      return true;
+   }
+
+   bool stealFront (unsigned id, T& t) {
+      std::lock_guard<std::mutex> lock(_deques[id].m);
+      if (_deques[id].items.empty()) return false;
+      t = std::move(_deques[id].items.front());
+      _deques[id].items.pop_front();
+      return true;
+   }
+};
@@ -3,9 +3,13 @@
 // created November 15, 2012
 //==============================================================================
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <boost/program_options.hpp>
 #include "Backup.h"
+#include "Metrics.h"
+#include "Throttle.h"
 
 using namespace std;
 using boost::filesystem::path;
@@ -30,7 +34,38 @@ int main (int argc, char** argv) {
        ("show-issues,i", "Print file conflicts that must be manually resolved.")
        ("copy,c",        "Copy directory A's unique files to directory B.")
        ("delete,d",      "Delete directory B's unique files.")
+       ("delete-first",  "With -c and -d, delete before copying rather than after, to free space for the new copies.")
+       ("update,u",      "Treat shared files that changed in A (different size, or newer) as modified rather than in conflict, and rewrite them in B if invoked with -c.")
+       ("delta",         "With -u and -c, send large modified files as deltas, reading both copies but writing only the blocks that changed.")
+       ("inplace",       "With --delta, patch files in B in place when no blocks have moved. Faster, but an interrupted update leaves a half-written file.")
+       ("stream",        "With -c or -d, copy and delete while comparing rather than after, using memory in proportion to the directories waiting to be compared rather than to the size of the tree.")
+       ("preserve,p",    "Give copies the mode, ownership, and times of the originals (and directories too, once done), so later runs can trust sizes and mtimes.")
+       ("xattrs",        "With -p, copy extended attributes (and so ACLs) too.")
+       ("moves",         "With -c and -d, look for files (and directories) moved or renamed in A among those to be deleted from B, and move them in B instead of copying them again.")
+       ("hard-links,H",  "Copy files with several names in A once, and make their other names in B hard links to the copy.")
+       ("dedup",         po::value<std::string>()->default_value("none"),
+                         "What to do with files to be copied whose contents match one copied before them: none (copy them anyway), link (hard link them to its copy), or clone (reflink them from its copy).")
+       ("progress",      po::value<double>()->default_value(2), "Seconds between progress reports (with rates and time left) while copying or deleting, or 0 for none.")
+       ("stats",         po::value<std::string>(), "When done, write the time, system calls, and throughput of each phase to this file (or - for standard output) as JSON.")
+       ("bwlimit",       po::value<double>()->default_value(0), "Copy at most this many MiB a second (or 0 for no limit).")
+       ("files-limit",   po::value<double>()->default_value(0), "Copy or scan at most this many files a second (or 0 for no limit).")
+       ("io-class",      po::value<std::string>(), "Read and write in this I/O scheduling class: idle, best-effort[:LEVEL], or realtime:LEVEL (levels are 0 to 7, highest first).")
+       ("adaptive",      po::value<double>()->default_value(0), "Copy with up to -j threads, but fewer while reads from A's device take longer than this many milliseconds on average (or 0 to always use -j).")
+       ("trace",         po::value<std::string>(), "Record each directory scan, file copied, and file deleted, by thread, and when done write them to this file as a Chrome trace (for Perfetto or chrome://tracing).")
        ("safe,s",        "Run in Safe Mode: no files are created, modified, or removed.")
+       ("engine",        po::value<std::string>()->default_value("auto"),
+                         "How to copy: auto, copy_file_range, sendfile, splice, io_uring, or stream.")
+       ("buffer-size",   po::value<unsigned>()->default_value(1024), "Size in KiB of each buffer used by the io_uring and stream engines.")
+       ("queue-depth",   po::value<unsigned>()->default_value(8), "Number of buffers the io_uring engine keeps in flight.")
+       ("direct",        "With the io_uring engine, bypass the page cache (O_DIRECT) for files of 64 MiB or more.")
+       ("durability",    po::value<std::string>()->default_value("none"),
+                         "How to make new copies survive a crash: none, file (sync each), atomic (sync each to a temporary file and rename it into place), or batch (atomic, but syncing a few hundred files at a time).")
+       ("catalog",       po::value<std::string>(), "Remember which directories are fully backed up in this file, and skip them next time if unchanged (except with -u or --verify).")
+       ("verify",        "Hash the contents of files in both directories, rather than trusting matching sizes.")
+       ("hash-cache",    po::value<std::string>(), "Keep file hashes in this file, so unchanged files needn't be read to verify them again.")
+       ("jobs,j",        po::value<unsigned>()->default_value(1), "Number of threads used to compare directories and copy files.")
+       ("split-size",    po::value<unsigned>()->default_value(1024), "With -j, files of at least this many MiB are copied in chunks by several threads at once.")
+       ("clone",         "Clone (reflink) files when A and B are on the same btrfs or XFS volume, copying only those that can't be.")
        ("dir_a",         "Directory A - the directory that should be backed up.")
        ("dir_b",         "Directory B - the directory where the backup copy is (or will be) located.")
    ;
@@ -88,7 +123,9 @@ int main (int argc, char** argv) {
    bool showIssues = false;
    bool copy       = false;
    bool del        = false;
+   bool update     = false;
    bool safe       = false;
+   bool clone      = false;
    if (vm.count("outline"))     { outline    = true; }
    if (vm.count("show-a"))      { showA      = true; }
    if (vm.count("show-b"))      { showB      = true; }
@@ -96,7 +133,47 @@ int main (int argc, char** argv) {
    if (vm.count("show-issues")) { showIssues = true; }
    if (vm.count("copy"))        { copy       = true; }
    if (vm.count("delete"))      { del        = true; }
+   if (vm.count("update"))      { update     = true; }
    if (vm.count("safe"))        { safe       = true; }
+   if (vm.count("clone"))       { clone      = true; }
+   std::string engine = vm["engine"].as<std::string>();
+   CopyEngineList engines;
+   if (!makeCopyEngines(engine, engines)) {
+      cout << "Error: " << engine << " is not a copy engine on this platform!\n";
+      return 0;
+   }
+   std::string durability = vm["durability"].as<std::string>();
+   Durability level;
+   if (durability == "none") {
+      level = Durability::None;
+   } else if (durability == "file") {
+      level = Durability::File;
+   } else if (durability == "atomic") {
+      level = Durability::Atomic;
+   } else if (durability == "batch") {
+      level = Durability::Batch;
+   } else {
+      cout << "Error: " << durability << " is not a durability (none, file, atomic, or batch)!\n";
+      return 0;
+   }
+   std::string dedup = vm["dedup"].as<std::string>();
+   Dedup same;
+   if (dedup == "none") {
+      same = Dedup::None;
+   } else if (dedup == "link") {
+      same = Dedup::Link;
+   } else if (dedup == "clone") {
+      same = Dedup::Clone;
+   } else {
+      cout << "Error: " << dedup << " is not a dedup mode (none, link, or clone)!\n";
+      return 0;
+   }
+   if (vm.count("io-class") && !setIoClass(vm["io-class"].as<std::string>())) {
+      cout << "Error: Couldn't set the I/O class to " << vm["io-class"].as<std::string>() << "!\n";
+      return 0;
+   }
+   throttle.bytes.setRate(vm["bwlimit"].as<double>() * (1 << 20));
+   throttle.files.setRate(vm["files-limit"].as<double>());
 
 
    // Execute the requested actions.
@@ -104,6 +181,28 @@ int main (int argc, char** argv) {
       // Create DirectoryComparer and set directories.
       DirectoryComparer dc;
       dc.setSafeMode(safe);
+      dc.setCopyEngine(engine);
+      CopyEngineOptions options;
+      options.buffer_bytes = size_t(std::max(1u, vm["buffer-size"].as<unsigned>())) << 10;
+      options.queue_depth = std::max(1u, vm["queue-depth"].as<unsigned>());
+      options.direct = vm.count("direct");
+      dc.setEngineOptions(options);
+      dc.setCloneMode(clone);
+      dc.setJobs(vm["jobs"].as<unsigned>());
+      dc.setSplitSize(FileSize::sizeType(vm["split-size"].as<unsigned>()) << 20);
+      if (vm.count("catalog")) dc.setCatalog(vm["catalog"].as<std::string>());
+      dc.setUpdateMode(update);
+      dc.setDeltaMode(vm.count("delta"), vm.count("inplace"));
+      dc.setStreamMode(vm.count("stream"));
+      dc.setDurability(level);
+      dc.setPreserve(vm.count("preserve"), vm.count("xattrs"));
+      dc.setMoveMode(vm.count("moves"));
+      dc.setLinks(vm.count("hard-links"), same);
+      dc.setDeleteFirst(vm.count("delete-first"));
+      dc.setProgressInterval(unsigned(std::max(0.0, vm["progress"].as<double>()) * 1000));
+      dc.setAdaptive(vm["adaptive"].as<double>());
+      if (vm.count("trace")) tracer.enable();
+      dc.setVerify(vm.count("verify"), vm.count("hash-cache") ? vm["hash-cache"].as<std::string>() : std::string());
       dc.setPaths(dirA, dirB);
 
       if (outline) {
@@ -122,6 +221,24 @@ int main (int argc, char** argv) {
       cout << "An unexpected error occurred! Were any files in either directory modified during execution?\n";
    }
 
+   // Write out the totals (even if we stopped early).
+   if (vm.count("stats")) {
+      std::string file = vm["stats"].as<std::string>();
+      if (file == "-") {
+         metrics.write(cout);
+      } else {
+         std::ofstream out(file.c_str());
+         metrics.write(out);
+         if (!out) cout << "Error: Couldn't write stats to " << file << "!\n";
+      }
+   }
+   if (vm.count("trace")) {
+      std::string file = vm["trace"].as<std::string>();
+      std::ofstream out(file.c_str());
+      tracer.write(out);
+      if (!out) cout << "Error: Couldn't write trace to " << file << "!\n";
+   }
+
    return 0;
 }
 
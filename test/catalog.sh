@@ -0,0 +1,36 @@
+#!/bin/sh
+#===============================================================================
+# catalog.sh
+# created October 16, 2026
+#===============================================================================
+#
+# Checks that a catalog doesn't keep -u from updating a file rewritten in place,
+# which leaves its directory's mtime alone. Runs bin/backup (or BIN/backup) in
+# a scratch directory under TEST_DIR, and exits nonzero on failure.
+
+set -e
+
+BIN=${BIN:-bin}
+DIR=${TEST_DIR:-/tmp/backup-test}/catalog
+
+fail () {
+   echo "catalog.sh: $*" >&2
+   exit 1
+}
+
+rm -rf "$DIR"
+mkdir -p "$DIR/A/sub" "$DIR/B"
+printf 'old' > "$DIR/A/sub/f.txt"
+"$BIN/backup" --progress 0 -c "$DIR/A" "$DIR/B" > /dev/null
+"$BIN/backup" --progress 0 -o --catalog "$DIR/cat" "$DIR/A" "$DIR/B" > /dev/null
+[ -f "$DIR/cat" ] || fail "no catalog was written"
+
+# rewrite the file (which leaves its directory alone), making it newer than B's
+printf 'new' > "$DIR/A/sub/f.txt"
+touch -d '+1 minute' "$DIR/A/sub/f.txt"
+
+"$BIN/backup" --progress 0 -u -c --catalog "$DIR/cat" "$DIR/A" "$DIR/B" > /dev/null
+[ "$(cat "$DIR/B/sub/f.txt")" = new ] || fail "-u with --catalog left B/sub/f.txt out of date"
+
+rm -rf "$DIR"
+echo "catalog.sh: passed"